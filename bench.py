@@ -0,0 +1,257 @@
+"""Benchmarks Treap and PersistentTreap against list, deque and blist.
+
+Every (container, operation, size) case runs in a fresh subprocess so that
+the reported peak RSS belongs to that case alone. Results are printed as a
+table and saved as JSON for comparison between runs:
+
+    python3 bench.py --sizes 1e3,1e5 --out bench.json
+    python3 bench.py --compare old.json --out new.json
+"""
+
+import argparse
+import json
+import os
+import platform
+import random
+import resource
+import subprocess
+import sys
+import time
+from collections import deque
+
+from treap import Treap, PersistentTreap
+
+try:
+    from blist import blist
+except ImportError:
+    blist = None
+
+CONTAINERS = {
+    'Treap': Treap,
+    'PersistentTreap': PersistentTreap,
+    'list': list,
+    'deque': deque,
+}
+if blist is not None:
+    CONTAINERS['blist'] = blist
+
+OPERATIONS = ['build', 'append', 'pop', 'insert', 'erase', 'index', 'slice',
+              'concat', 'iterate', 'versions']
+
+DEFAULT_SIZES = [10 ** 3, 10 ** 4, 10 ** 5, 10 ** 6, 10 ** 7]
+
+# operations timed per case, besides build and iterate which touch every element
+OPS_PER_CASE = 1000
+
+# a version kept by copying costs size elements; skip cases above this many
+COPY_BUDGET = 10 ** 8
+
+
+def persistent(name):
+    return name == 'PersistentTreap'
+
+
+def bench_build(name, cls, size, ops):
+    data = list(range(size))
+    start = time.perf_counter()
+    cls(data)
+    return time.perf_counter() - start, size
+
+
+def bench_append(name, cls, size, ops):
+    c = cls(range(size))
+    start = time.perf_counter()
+    if persistent(name):
+        for i in range(ops):
+            c = c.append(i)
+    else:
+        for i in range(ops):
+            c.append(i)
+    return time.perf_counter() - start, ops
+
+
+def bench_pop(name, cls, size, ops):
+    c = cls(range(size))
+    ops = min(ops, size)
+    start = time.perf_counter()
+    if persistent(name):
+        for _ in range(ops):
+            c = c.pop()
+    else:
+        for _ in range(ops):
+            c.pop()
+    return time.perf_counter() - start, ops
+
+
+def bench_insert(name, cls, size, ops):
+    c = cls(range(size))
+    positions = [random.randrange(size + i + 1) for i in range(ops)]
+    start = time.perf_counter()
+    if persistent(name):
+        for i, pos in enumerate(positions):
+            c = c.insert(pos, i)
+    else:
+        for i, pos in enumerate(positions):
+            c.insert(pos, i)
+    return time.perf_counter() - start, ops
+
+
+def bench_erase(name, cls, size, ops):
+    c = cls(range(size))
+    ops = min(ops, size)
+    positions = [random.randrange(size - i) for i in range(ops)]
+    start = time.perf_counter()
+    if persistent(name):
+        for pos in positions:
+            c = c.erase(pos)
+    elif name in ('Treap',):
+        for pos in positions:
+            c.erase(pos)
+    else:
+        for pos in positions:
+            del c[pos]
+    return time.perf_counter() - start, ops
+
+
+def bench_index(name, cls, size, ops):
+    c = cls(range(size))
+    positions = [random.randrange(size) for _ in range(ops)]
+    start = time.perf_counter()
+    for pos in positions:
+        c[pos]
+    return time.perf_counter() - start, ops
+
+
+def bench_slice(name, cls, size, ops):
+    c = cls(range(size))
+    if name == 'deque':
+        return None
+    bounds = [sorted((random.randrange(size), random.randrange(size))) for _ in range(ops)]
+    start = time.perf_counter()
+    for begin, end in bounds:
+        c[begin:end]
+    return time.perf_counter() - start, ops
+
+
+def bench_concat(name, cls, size, ops):
+    c = cls(range(size))
+    ops = max(1, min(ops, COPY_BUDGET // (2 * size))) if name in ('list', 'deque') else ops
+    start = time.perf_counter()
+    for _ in range(ops):
+        c + c
+    return time.perf_counter() - start, ops
+
+
+def bench_iterate(name, cls, size, ops):
+    c = cls(range(size))
+    start = time.perf_counter()
+    for _ in c:
+        pass
+    return time.perf_counter() - start, size
+
+
+def bench_versions(name, cls, size, ops):
+    """Appends while keeping every intermediate version alive."""
+    c = cls(range(size))
+    versions = []
+    if name in ('list', 'deque', 'blist'):
+        if name != 'blist' and size * ops > COPY_BUDGET:
+            return None
+        start = time.perf_counter()
+        for i in range(ops):
+            c = cls(c) if name != 'blist' else c[:]
+            c.append(i)
+            versions.append(c)
+    elif persistent(name):
+        start = time.perf_counter()
+        for i in range(ops):
+            c = c.append(i)
+            versions.append(c)
+    else:
+        start = time.perf_counter()
+        for i in range(ops):
+            versions.append(PersistentTreap(c))
+            c.append(i)
+    return time.perf_counter() - start, ops
+
+
+def run_case(name, op, size):
+    random.seed(size)
+    result = globals()['bench_' + op](name, CONTAINERS[name], size, OPS_PER_CASE)
+    peak = resource.getrusage(resource.RUSAGE_SELF).ru_maxrss * 1024
+    if result is None:
+        return {'skipped': True}
+    elapsed, count = result
+    return {'ns_per_op': elapsed * 1e9 / count, 'ops': count, 'peak_rss': peak}
+
+
+def spawn_case(name, op, size, timeout):
+    cmd = [sys.executable, os.path.abspath(__file__), '--case', name, op, str(size)]
+    try:
+        out = subprocess.run(cmd, stdout=subprocess.PIPE, timeout=timeout, check=True).stdout
+        return json.loads(out.decode())
+    except subprocess.TimeoutExpired:
+        return {'skipped': True, 'reason': 'timeout'}
+    except subprocess.CalledProcessError as e:
+        return {'skipped': True, 'reason': 'exit code %d' % e.returncode}
+
+
+def parse_list(text, convert):
+    return [convert(item) for item in text.split(',') if item]
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument('--sizes', default=','.join(str(s) for s in DEFAULT_SIZES),
+                        help='comma separated sizes, e.g. 1e3,1e5')
+    parser.add_argument('--containers', default=','.join(CONTAINERS))
+    parser.add_argument('--ops', default=','.join(OPERATIONS))
+    parser.add_argument('--timeout', type=float, default=600, help='seconds per case')
+    parser.add_argument('--out', default='bench.json', help='where to save the results')
+    parser.add_argument('--compare', help='earlier results to print ratios against')
+    parser.add_argument('--case', nargs=3, help=argparse.SUPPRESS)
+    args = parser.parse_args()
+
+    if args.case:
+        name, op, size = args.case
+        print(json.dumps(run_case(name, op, int(size))))
+        return
+
+    sizes = parse_list(args.sizes, lambda s: int(float(s)))
+    names = [n for n in parse_list(args.containers, str) if n in CONTAINERS]
+    ops = parse_list(args.ops, str)
+    baseline = {}
+    if args.compare:
+        with open(args.compare) as f:
+            baseline = {(r['container'], r['op'], r['size']): r for r in json.load(f)['results']}
+
+    results = []
+    print('%-16s %-9s %10s %14s %12s' % ('container', 'op', 'size', 'ns/op', 'peak MB'))
+    for op in ops:
+        for size in sizes:
+            for name in names:
+                row = dict(container=name, op=op, size=size)
+                row.update(spawn_case(name, op, size, args.timeout))
+                results.append(row)
+                if row.get('skipped'):
+                    print('%-16s %-9s %10d %14s' % (name, op, size, 'skipped'))
+                    continue
+                line = '%-16s %-9s %10d %14.1f %12.1f' % (name, op, size, row['ns_per_op'], row['peak_rss'] / 2 ** 20)
+                old = baseline.get((name, op, size))
+                if old and not old.get('skipped'):
+                    line += '   x%.2f' % (row['ns_per_op'] / old['ns_per_op'])
+                print(line)
+                sys.stdout.flush()
+
+    meta = {
+        'python': platform.python_version(),
+        'machine': platform.machine(),
+        'time': time.strftime('%Y-%m-%dT%H:%M:%S'),
+        'blist': blist is not None,
+    }
+    with open(args.out, 'w') as f:
+        json.dump({'meta': meta, 'results': results}, f, indent=1)
+
+
+if __name__ == '__main__':
+    main()
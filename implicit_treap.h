@@ -7,6 +7,19 @@
 #include <utility>
 #include <vector>
 #include <algorithm>
+#include <atomic>
+#include <functional>
+#include <future>
+#include <limits>
+#include <random>
+#include <stdexcept>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+
+#ifdef TREAP_ARENA
+#include "node_arena.h"
+#endif
 
 #ifdef PYTHON
 #include <Python.h>
@@ -18,7 +31,14 @@
 
 using namespace std;
 
+// Sizes and positions. Shared subtrees make sequences of more than 2^31
+// elements cheap, so sizes are 64-bit unless TREAP_COMPACT_SIZE asks for
+// smaller nodes.
+#ifdef TREAP_COMPACT_SIZE
 typedef int32_t treap_size_t;
+#else
+typedef int64_t treap_size_t;
+#endif
 
 namespace impl {
 
@@ -40,17 +60,131 @@ string py_type(PyObject *obj) {
 #endif 
 
 template <class T>
-class node {
+class node;
+
+#ifdef TREAP_ARENA
+template <class T>
+using node_ptr = arena_ptr<T>;
+#else
+template <class T>
+using node_ptr = shared_ptr<const node<T>>;
+#endif
+
+// Small values that are cheap to copy are stored inline. Anything else
+// lives in a shared immutable cell, so that copying a node while path
+// copying never copies the value itself.
+template <class T, bool Inline = std::is_trivially_destructible<T>::value && sizeof(T) <= 2 * sizeof(void*)>
+class value_cell;
+
+// selects the value_cell constructor that builds the value in place from its arguments
+struct emplace_tag { };
+
+template <class T>
+class value_cell<T, true> {
+public:
+    static const bool is_inline = true;
+    explicit value_cell(const T& val) : _Val(val) { }
+    explicit value_cell(T&& val) : _Val(std::move(val)) { }
+    template <class... Args>
+    value_cell(emplace_tag, Args&&... args) : _Val(std::forward<Args>(args)...) { }
+    const T& get() const { return _Val; }
+private:
+    T _Val;
+};
+
+template <class T>
+class value_cell<T, false> {
+public:
+    static const bool is_inline = false;
+    explicit value_cell(const T& val) : _Val(make_shared<const T>(val)) { }
+    explicit value_cell(T&& val) : _Val(make_shared<const T>(std::move(val))) { }
+    template <class... Args>
+    value_cell(emplace_tag, Args&&... args) : _Val(make_shared<const T>(std::forward<Args>(args)...)) { }
+    const T& get() const { return *_Val; }
+private:
+    shared_ptr<const T> _Val;
+};
+
+// Specialize (in namespace impl) for an element type to keep a monoid
+// summary of every subtree in its nodes; sum_summary and friends below are
+// ready-made ones to derive from.
+template <class T>
+struct summary_traits {
+    static const bool enabled = false;
+};
+
+template <class T>
+struct sum_summary {
+    static const bool enabled = true;
+    typedef T type;
+    static T identity() { return T(); }
+    static T of(const T& val) { return val; }
+    static T combine(const T& lhs, const T& rhs) { return lhs + rhs; }
+};
+
+template <class T>
+struct max_summary {
+    static const bool enabled = true;
+    typedef T type;
+    static T identity() { return numeric_limits<T>::lowest(); }
+    static T of(const T& val) { return val; }
+    static T combine(const T& lhs, const T& rhs) { return max(lhs, rhs); }
+};
+
+template <class T>
+struct min_summary {
+    static const bool enabled = true;
+    typedef T type;
+    static T identity() { return numeric_limits<T>::max(); }
+    static T of(const T& val) { return val; }
+    static T combine(const T& lhs, const T& rhs) { return min(lhs, rhs); }
+};
+
+template <class T, bool Enabled = summary_traits<T>::enabled>
+class summary_holder {
+protected:
+    template <class TNode>
+    void init_summary(const T& val, const TNode& left, const TNode& right) { }
+};
+
+template <class T>
+class summary_holder<T, true> {
+public:
+    typedef summary_traits<T> traits;
+
+    const typename traits::type& summary() const { return _Summary; }
+protected:
+    template <class TNode>
+    void init_summary(const T& val, const TNode& left, const TNode& right) {
+        _Summary = traits::of(val);
+        if (left) 
+            _Summary = traits::combine(left->summary(), _Summary);
+        if (right) 
+            _Summary = traits::combine(_Summary, right->summary());
+    }
+
+    typename traits::type _Summary;
+};
+
+template <class T>
+class node : public summary_holder<T> {
 public:
     node(const T& val, 
-        shared_ptr<const node<T>> left = nullptr, 
-        shared_ptr<const node<T>> right = nullptr); 
+        node_ptr<T> left = nullptr, 
+        node_ptr<T> right = nullptr); 
+    node(T&& val, 
+        node_ptr<T> left = nullptr, 
+        node_ptr<T> right = nullptr); 
+    node(const value_cell<T>& cell, 
+        node_ptr<T> left = nullptr, 
+        node_ptr<T> right = nullptr); 
    
-    const shared_ptr<const node<T>> left() const;
-    const shared_ptr<const node<T>> right() const;
+    const node_ptr<T> left() const;
+    const node_ptr<T> right() const;
 
     const treap_size_t size() const;
     const T& val() const;
+    const value_cell<T>& cell() const { return _Val; }
 
 #ifdef PYTHON
     const int refcount() const {
@@ -60,63 +194,75 @@ public:
 
     template <class T1>
     friend bool greater_priority(
-        shared_ptr<const node<T1>> lhs, 
-        shared_ptr<const node<T1>> rhs
+        node_ptr<T1> lhs, 
+        node_ptr<T1> rhs
         );
 
-    template <class T1>
-    friend bool greater_priority(
-        shared_ptr<const node<T1>> lhs
-        ); // priority compared with singleton
-
     const treap_size_t height() const;
 
     template <class T1>
-    friend const pair<shared_ptr<const node<T1>>, shared_ptr<const node<T1>>> split(
-        shared_ptr<const node<T1>> tree, 
+    friend const pair<node_ptr<T1>, node_ptr<T1>> split(
+        node_ptr<T1> tree, 
         treap_size_t pos
         );
     
     template <class T1>
-    friend shared_ptr<const node<T1>> merge(
-        shared_ptr<const node<T1>> lhs, 
-        shared_ptr<const node<T1>> rhs
+    friend node_ptr<T1> merge(
+        node_ptr<T1> lhs, 
+        node_ptr<T1> rhs
         );
 
     template <class T1, class TIter> 
-    friend shared_ptr<const node<T1>> build(TIter begin, TIter end);
+    friend node_ptr<T1> build(TIter begin, TIter end);
 
     ~node() {  
 #ifdef PYTHON
         if (std::is_same<T,PyObject*>::value) {
-            Py_DECREF(reinterpret_cast<PyObject*>(_Val));
+            Py_DECREF(reinterpret_cast<PyObject*>(val()));
         }
 #endif
     }
 private:
-    T _Val;
+    value_cell<T> _Val;
     treap_size_t _Size;
-    shared_ptr<const node<T>> _Left, _Right;
+    node_ptr<T> _Left, _Right;
     
 }; 
 
+template <class T, class... Args>
+node_ptr<T> make_node(Args&&... args) {
+#ifdef TREAP_ARENA
+    return arena_ptr<T>::make(std::forward<Args>(args)...);
+#else
+    return make_shared<const node<T>>(std::forward<Args>(args)...);
+#endif
+}
+
+template <class T>
+node<T>::node(const T& val, node_ptr<T> left, node_ptr<T> right) : node(value_cell<T>(val), left, right) {
+}
+
+template <class T>
+node<T>::node(T&& val, node_ptr<T> left, node_ptr<T> right) : node(value_cell<T>(std::move(val)), left, right) {
+}
+
 template <class T>
-node<T>::node(const T& val, shared_ptr<const node<T>> left, shared_ptr<const node<T>> right) : _Val(val), _Left(left), _Right(right), _Size(1 + left->size() + right->size()) {
+node<T>::node(const value_cell<T>& cell, node_ptr<T> left, node_ptr<T> right) : _Val(cell), _Left(left), _Right(right), _Size(1 + left->size() + right->size()) {
 #ifdef PYTHON
     if (std::is_same<T,PyObject*>::value) {
-        Py_INCREF(reinterpret_cast<PyObject*>(_Val));
+        Py_INCREF(reinterpret_cast<PyObject*>(val()));
     }
 #endif
-    // TODO: calculate operation values
+    this->init_summary(val(), _Left, _Right);
 }
 
 template <class T>
-const shared_ptr<const node<T>> node<T>::left() const { 
+const node_ptr<T> node<T>::left() const { 
     return this ? _Left : nullptr; 
 }
 
 template <class T>
-const shared_ptr<const node<T>> node<T>::right() const { 
+const node_ptr<T> node<T>::right() const { 
     return this ? _Right : nullptr; 
 }
 
@@ -127,7 +273,7 @@ const treap_size_t node<T>::size() const {
 
 template <class T>
 const T& node<T>::val() const { 
-    return _Val; 
+    return _Val.get(); 
 }
 
 template <class T>
@@ -135,20 +281,45 @@ const treap_size_t node<T>::height() const {
     return this ? max(left()->height(), right()->height()) + 1 : 0; 
 }
 
-template <class T1>
-bool greater_priority(shared_ptr<const node<T1>> lhs, shared_ptr<const node<T1>> rhs) {
-    return (rand() % (lhs->_Size + rhs->_Size)) < lhs->_Size;
-    
+// Every thread draws priorities from a generator of its own, since no
+// generator can be shared safely. A thread starts from the next seed of a
+// fixed sequence; async_seeded reseeds the threads it starts from the
+// starting thread, so that shapes do not depend on thread scheduling.
+inline mt19937_64& thread_random() {
+    static atomic<uint64_t> next_seed{ 0 };
+    static thread_local mt19937_64 engine(0x9e3779b97f4a7c15ULL * ++next_seed);
+    return engine;
+}
+
+inline uint64_t random_below(uint64_t bound) {
+    return thread_random()() % bound;
+}
+
+// runs f on a new thread whose generator is seeded from this thread's
+template <class F>
+future<typename result_of<F()>::type> async_seeded(F f) {
+    uint64_t seed = thread_random()();
+    return async(launch::async, [f, seed]() {
+        thread_random().seed(seed);
+        return f();
+    });
+}
+
+// sum of two sizes, or length_error if it does not fit in treap_size_t
+inline treap_size_t checked_size_add(treap_size_t lhs, treap_size_t rhs) {
+    if (rhs > 0 && lhs > numeric_limits<treap_size_t>::max() - rhs)
+        throw length_error("persistent_treap: size exceeds treap_size_t");
+    return lhs + rhs;
 }
 
 template <class T1>
-bool greater_priority(shared_ptr<const node<T1>> lhs) {
-    return rand() % 2; // I have no idea why it works
-    //return (rand() % (lhs->_Size + 1)) < lhs->_Size;
+bool greater_priority(node_ptr<T1> lhs, node_ptr<T1> rhs) {
+    return treap_size_t(random_below(lhs->_Size + rhs->_Size)) < lhs->_Size;
+    
 }
 
 template <class T>
-void preorder_walk(shared_ptr<const node<T>> t, void (*f)(shared_ptr<const node<T>>)) {
+void preorder_walk(node_ptr<T> t, void (*f)(node_ptr<T>)) {
     if (t) {
         f(t);
         preorder_walk(t->left(), f);
@@ -157,7 +328,7 @@ void preorder_walk(shared_ptr<const node<T>> t, void (*f)(shared_ptr<const node<
 }
 
 template <class T>
-void postorder_walk(shared_ptr<const node<T>> t, void (*f)(shared_ptr<const node<T>>)) {
+void postorder_walk(node_ptr<T> t, void (*f)(node_ptr<T>)) {
     if (t) {
         postorder_walk(t->left(), f);
         postorder_walk(t->right(), f);
@@ -166,7 +337,7 @@ void postorder_walk(shared_ptr<const node<T>> t, void (*f)(shared_ptr<const node
 }
 
 template <class T>
-void inorder_walk(shared_ptr<const node<T>> t, void (*f)(shared_ptr<const node<T>>)) {
+void inorder_walk(node_ptr<T> t, void (*f)(node_ptr<T>)) {
     if (t) {
         inorder_walk(t->left(), f);
         f(t);
@@ -176,7 +347,7 @@ void inorder_walk(shared_ptr<const node<T>> t, void (*f)(shared_ptr<const node<T
 
 #ifdef DEBUG
 template <class T> 
-void structural_print(shared_ptr<const node<T>> nd) {
+void structural_print(node_ptr<T> nd) {
     if (!nd) 
         return;
     if (nd->left()) {
@@ -201,7 +372,7 @@ void structural_print(shared_ptr<const node<T>> nd) {
 }
 
 template <class T>
-void node_debug_print(shared_ptr<const node<T>> t) {
+void node_debug_print(node_ptr<T> t) {
     if (t) {
         cerr << '(';
         node_debug_print(t->left());
@@ -220,7 +391,7 @@ void node_debug_print(shared_ptr<const node<T>> t) {
 }
 #ifdef PYTHON
 template <class T>
-void py_node_debug_print(shared_ptr<const node<T>> t) {
+void py_node_debug_print(node_ptr<T> t) {
     if (t) {
         cerr << '(';
         py_node_debug_print(t->left());
@@ -237,59 +408,413 @@ void py_node_debug_print(shared_ptr<const node<T>> t) {
 #endif
 
 template <class T1>
-const pair<shared_ptr<const node<T1>>, shared_ptr<const node<T1>>> split(
-    shared_ptr<const node<T1>> tree, 
+const pair<node_ptr<T1>, node_ptr<T1>> split(
+    node_ptr<T1> tree, 
     treap_size_t pos) {
     
-    if (!tree)
-        return make_pair(nullptr, nullptr);
+    // cuts at either end copy nothing
+    if (pos <= 0)
+        return make_pair(nullptr, tree);
+    if (pos >= tree->size())
+        return make_pair(tree, nullptr);
     if (tree->left()->size() >= pos) {
         auto splitted = split(tree->left(), pos);
-        return make_pair(splitted.first, make_shared<const node<T1>>(tree->_Val, splitted.second, tree->right()));
+        return make_pair(splitted.first, make_node<T1>(tree->_Val, splitted.second, tree->right()));
     }
     else {
         auto splitted = split(tree->right(), pos - tree->left()->size() - 1);
-        return make_pair(make_shared<const node<T1>>(tree->_Val, tree->left(), splitted.first), splitted.second);
+        return make_pair(make_node<T1>(tree->_Val, tree->left(), splitted.first), splitted.second);
     }
 }
 
 template <class T1>
-shared_ptr<const node<T1>> merge(
-    shared_ptr<const node<T1>> lhs, 
-    shared_ptr<const node<T1>> rhs) {
+node_ptr<T1> merge(
+    node_ptr<T1> lhs, 
+    node_ptr<T1> rhs) {
+
+    if (!lhs) return rhs;
+    if (!rhs) return lhs;
+    if (greater_priority(lhs, rhs)) {
+        return make_node<T1>(lhs->_Val, lhs->left(), merge(lhs->right(), rhs));
+    }
+    else {
+        return make_node<T1>(rhs->_Val, merge(lhs, rhs->left()), rhs->right());
+    }
+}
+
+// splits tree at every position of [cut_begin, cut_end) (sorted, relative to
+// the beginning of the tree shifted by base) in one recursive descent
+template <class T1, class TIter1>
+void split_many(
+    node_ptr<T1> tree, 
+    TIter1 cut_begin, 
+    TIter1 cut_end, 
+    treap_size_t base, 
+    vector<node_ptr<T1>>& pieces) {
+
+    if (cut_begin == cut_end) {
+        pieces.push_back(tree);
+        return;
+    }
+    TIter1 cut_mid = cut_begin + (cut_end - cut_begin) / 2;
+    auto splitted = split(tree, *cut_mid - base);
+    split_many(splitted.first, cut_begin, cut_mid, base, pieces);
+    split_many(splitted.second, cut_mid + 1, cut_end, *cut_mid, pieces);
+}
+
+// merges all trees in order, pairing neighbours so that no tree takes part in more than O(log k) merges
+template <class T1>
+node_ptr<T1> merge_all(vector<node_ptr<T1>> trees) {
+    if (trees.empty())
+        return nullptr;
+    while (trees.size() > 1) {
+        size_t half = 0;
+        for (size_t i = 0; i < trees.size(); i += 2)
+            trees[half++] = i + 1 < trees.size() ? merge(trees[i], trees[i + 1]) : trees[i];
+        trees.resize(half);
+    }
+    return trees[0];
+}
+
+// subtrees smaller than this are never handed to another thread
+const treap_size_t parallel_cutoff = 1 << 12;
+
+// Levels of a recursion that may fork, so that about one thread per hardware
+// thread runs at a time; the recursion passes depth - 1 to its calls.
+inline int parallel_depth() {
+    unsigned threads = max(thread::hardware_concurrency(), 1u);
+    int depth = 0;
+    while ((1u << depth) < threads)
+        depth++;
+    return depth;
+}
+
+template <class T1, class F, class G>
+pair<node_ptr<T1>, node_ptr<T1>> fork_join(bool parallel, F left, G right) {
+    if (!parallel)
+        return make_pair(left(), right());
+    auto left_future = async_seeded([&left]() { return left(); });
+    auto right_result = right();
+    return make_pair(left_future.get(), right_result);
+}
+
+// Joins lhs, val and rhs in one descent. val becomes the root with
+// probability 1 / (size of the result), the chance it has with random
+// priorities, and otherwise goes down the spine of the side that wins.
+template <class T1>
+node_ptr<T1> join(
+    node_ptr<T1> lhs,
+    const value_cell<T1>& val,
+    node_ptr<T1> rhs) {
+
+    treap_size_t choice = random_below(lhs->size() + rhs->size() + 1);
+    if (choice < lhs->size())
+        return make_node<T1>(lhs->cell(), lhs->left(), join(lhs->right(), val, rhs));
+    if (choice < lhs->size() + rhs->size())
+        return make_node<T1>(rhs->cell(), join(lhs, val, rhs->left()), rhs->right());
+    return make_node<T1>(val, lhs, rhs);
+}
+
+// number of leading elements of tree for which before holds; tree must be partitioned by it
+template <class T1, class Pred>
+const treap_size_t partition_point(node_ptr<T1> tree, const Pred& before) {
+    treap_size_t result = 0;
+    while (tree) {
+        if (before(tree->val())) {
+            result += tree->left()->size() + 1;
+            tree = tree->right();
+        }
+        else {
+            tree = tree->left();
+        }
+    }
+    return result;
+}
+
+// merges two sorted trees; on equal elements those of lhs go first
+template <class T1, class Compare>
+node_ptr<T1> merge_sorted(
+    node_ptr<T1> lhs,
+    node_ptr<T1> rhs,
+    const Compare& comp,
+    int depth = parallel_depth()) {
 
     if (!lhs) return rhs;
     if (!rhs) return lhs;
+    bool parallel = depth > 0 && lhs->size() + rhs->size() >= parallel_cutoff;
     if (greater_priority(lhs, rhs)) {
-        return make_shared<const node<T1>>(lhs->_Val, lhs->left(), merge(lhs->right(), rhs));
+        const T1& pivot = lhs->val();
+        auto splitted = split(rhs, partition_point(rhs, [&](const T1& x) { return comp(x, pivot); }));
+        auto parts = fork_join<T1>(parallel,
+            [&]() { return merge_sorted(lhs->left(), splitted.first, comp, depth - 1); },
+            [&]() { return merge_sorted(lhs->right(), splitted.second, comp, depth - 1); });
+        return join(parts.first, lhs->cell(), parts.second);
     }
     else {
-        return make_shared<const node<T1>>(rhs->_Val, merge(lhs, rhs->left()), rhs->right());
+        const T1& pivot = rhs->val();
+        auto splitted = split(lhs, partition_point(lhs, [&](const T1& x) { return !comp(pivot, x); }));
+        auto parts = fork_join<T1>(parallel,
+            [&]() { return merge_sorted(splitted.first, rhs->left(), comp, depth - 1); },
+            [&]() { return merge_sorted(splitted.second, rhs->right(), comp, depth - 1); });
+        return join(parts.first, rhs->cell(), parts.second);
     }
 }
 
+// stable merge sort of cells, halves of at least parallel_cutoff elements are
+// sorted concurrently for the first depth levels
+template <class T1, class Compare>
+void parallel_sort(
+    typename vector<value_cell<T1>>::iterator begin,
+    typename vector<value_cell<T1>>::iterator end,
+    const Compare& comp,
+    int depth = parallel_depth()) {
+
+    auto cell_comp = [&](const value_cell<T1>& lhs, const value_cell<T1>& rhs) { return comp(lhs.get(), rhs.get()); };
+    if (depth <= 0 || end - begin < 2 * parallel_cutoff) {
+        stable_sort(begin, end, cell_comp);
+        return;
+    }
+    auto middle = begin + (end - begin) / 2;
+    auto left_future = async(launch::async, [&]() { parallel_sort<T1>(begin, middle, comp, depth - 1); });
+    parallel_sort<T1>(middle, end, comp, depth - 1);
+    left_future.get();
+    inplace_merge(begin, middle, end, cell_comp);
+}
+
+// Cartesian tree of the elements under random priorities, kept only while
+// building, so the result has the expected O(log n) height of a treap.
+// path is the right spine, its priorities decreasing from the root.
 template <class T1, class TIter1>
-shared_ptr<const node<T1>> build(TIter1 begin, TIter1 end) {
-    auto path = vector<shared_ptr<const node<T1>>>();
+node_ptr<T1> build(TIter1 begin, TIter1 end) {
+    auto path = vector<node_ptr<T1>>();
+    auto priorities = vector<uint64_t>();
+    auto& random = thread_random();
     for (TIter1 elem_ptr = begin; elem_ptr != end; elem_ptr++) {
-        shared_ptr<const node<T1>> prev_node_in_path = nullptr;
-        while (!path.empty() && greater_priority(path.back())) {
+        uint64_t priority = random();
+        node_ptr<T1> prev_node_in_path = nullptr;
+        while (!path.empty() && priorities.back() < priority) {
             if (path.back()->right() != prev_node_in_path) {
-                path.back() = make_shared<const node<T1>>(path.back()->val(), path.back()->left(), prev_node_in_path);
+                path.back() = make_node<T1>(path.back()->_Val, path.back()->left(), prev_node_in_path);
             }
             prev_node_in_path = path.back();
             path.pop_back();
+            priorities.pop_back();
         }
-        shared_ptr<const node<T1>> new_node = make_shared<const node<T1>>(*elem_ptr, prev_node_in_path, nullptr);
+        node_ptr<T1> new_node = make_node<T1>(*elem_ptr, prev_node_in_path, nullptr);
         path.push_back(new_node);
+        priorities.push_back(priority);
     }
     for (treap_size_t i = path.size() - 2; i >= 0; i--) {
         if (path[i]->right() != path[i+1]) 
-            path[i] = make_shared<const node<T1>>(path[i]->val(), path[i]->_Left, path[i+1]);
+            path[i] = make_node<T1>(path[i]->_Val, path[i]->_Left, path[i+1]);
     }
     return path.empty() ? nullptr : path[0];
 }
 
+// Cells shared by the blocks that view it. The filled range grows at either
+// end, one claim at a time: a block grows in place only if it starts or ends
+// exactly where the filled range does and wins the atomic claim on the slots
+// next to it, so the cells any block sees never change. Cells left out of
+// every view by a pop stay alive until the storage goes.
+template <class T>
+class block_storage {
+public:
+    // only cells that cannot throw on copy are constructed after a claim
+    static const bool can_grow = is_nothrow_copy_constructible<value_cell<T>>::value;
+
+    block_storage(treap_size_t capacity, treap_size_t start)
+        : _Cells(static_cast<value_cell<T>*>(::operator new(capacity * sizeof(value_cell<T>)))),
+          _Capacity(capacity), _Low(start), _High(start) { }
+    block_storage(const block_storage&) = delete;
+    block_storage& operator=(const block_storage&) = delete;
+
+    const value_cell<T>* cells() const { return _Cells; }
+    const treap_size_t capacity() const { return _Capacity; }
+
+    // claims [pos, pos + count) if the filled range ends at pos
+    bool claim_back(treap_size_t pos, treap_size_t count) {
+        auto expected = pos;
+        return pos + count <= _Capacity && _High.compare_exchange_strong(expected, pos + count);
+    }
+
+    // claims [pos - count, pos) if the filled range starts at pos
+    bool claim_front(treap_size_t pos, treap_size_t count) {
+        auto expected = pos;
+        return pos >= count && _Low.compare_exchange_strong(expected, pos - count);
+    }
+
+    // fills a claimed slot
+    void construct(treap_size_t pos, const value_cell<T>& val) {
+        new (_Cells + pos) value_cell<T>(val);
+#ifdef PYTHON
+        if (std::is_same<T,PyObject*>::value) {
+            Py_INCREF(reinterpret_cast<PyObject*>(val.get()));
+        }
+#endif
+    }
+
+    // appends before any block views the storage, so nothing is claimed ahead
+    void fill_back(const value_cell<T>& val) {
+        construct(_High.load(), val);
+        _High++;
+    }
+
+    ~block_storage() {
+        for (treap_size_t i = _Low.load(); i < _High.load(); i++) {
+#ifdef PYTHON
+            if (std::is_same<T,PyObject*>::value) {
+                Py_DECREF(reinterpret_cast<PyObject*>(_Cells[i].get()));
+            }
+#endif
+            _Cells[i].~value_cell<T>();
+        }
+        ::operator delete(_Cells);
+    }
+private:
+    value_cell<T>* _Cells;
+    treap_size_t _Capacity;
+    atomic<treap_size_t> _Low, _High;
+};
+
+// immutable view of a few consecutive cells of a block_storage
+template <class T>
+class flat_block {
+public:
+    flat_block(shared_ptr<block_storage<T>> storage, treap_size_t begin, treap_size_t end)
+        : _Storage(storage), _Begin(begin), _End(end) { }
+
+    const treap_size_t size() const {
+        return this ? _End - _Begin : 0;
+    }
+
+    const T& operator[](treap_size_t index) const {
+        return cell(index).get();
+    }
+
+    const value_cell<T>& cell(treap_size_t index) const {
+        return begin()[index];
+    }
+
+    const value_cell<T>* begin() const { return _Storage->cells() + _Begin; }
+    const value_cell<T>* end() const { return _Storage->cells() + _End; }
+
+    const block_storage<T>* storage() const { return _Storage.get(); }
+
+    shared_ptr<const flat_block<T>> slice(treap_size_t begin, treap_size_t end) const {
+        return make_shared<const flat_block<T>>(_Storage, _Begin + begin, _Begin + end);
+    }
+
+    // the block with [begin, end) after it, sharing the storage, or nullptr
+    // if another block has claimed the room after this one
+    template <class TIter>
+    shared_ptr<const flat_block<T>> grow_back(TIter begin, TIter end) const {
+        treap_size_t count = end - begin;
+        if (!block_storage<T>::can_grow || !_Storage->claim_back(_End, count))
+            return nullptr;
+        for (treap_size_t pos = _End; begin != end; ++begin)
+            _Storage->construct(pos++, *begin);
+        return make_shared<const flat_block<T>>(_Storage, _Begin, _End + count);
+    }
+
+    template <class TIter>
+    shared_ptr<const flat_block<T>> grow_front(TIter begin, TIter end) const {
+        treap_size_t count = end - begin;
+        if (!block_storage<T>::can_grow || !_Storage->claim_front(_Begin, count))
+            return nullptr;
+        for (treap_size_t pos = _Begin - count; begin != end; ++begin)
+            _Storage->construct(pos++, *begin);
+        return make_shared<const flat_block<T>>(_Storage, _Begin - count, _End);
+    }
+private:
+    shared_ptr<block_storage<T>> _Storage;
+    treap_size_t _Begin, _End;
+};
+
+// a block in storage of its own, with room to grow by front_room or back_room cells
+template <class T, class TIter>
+shared_ptr<const flat_block<T>> make_block(TIter begin, TIter end, treap_size_t front_room = 0, treap_size_t back_room = 0) {
+    if (begin == end)
+        return nullptr;
+    treap_size_t size = end - begin;
+    auto storage = make_shared<block_storage<T>>(front_room + size + back_room, front_room);
+    for (; begin != end; ++begin)
+        storage->fill_back(*begin);
+    return make_shared<const flat_block<T>>(storage, front_room, front_room + size);
+}
+
+// Pushing appends in place while the block is the latest grown from its
+// storage; otherwise the cells are copied into storage with room for as
+// many again, so that a run of pushes copies each cell O(1) times.
+template <class T>
+shared_ptr<const flat_block<T>> block_push_back(shared_ptr<const flat_block<T>> block, const value_cell<T>& val) {
+    auto grown = block ? block->grow_back(&val, &val + 1) : nullptr;
+    if (grown)
+        return grown;
+    auto vals = block ? vector<value_cell<T>>(block->begin(), block->end()) : vector<value_cell<T>>();
+    vals.push_back(val);
+    return make_block<T>(vals.begin(), vals.end(), 0, vals.size());
+}
+
+template <class T>
+shared_ptr<const flat_block<T>> block_push_front(shared_ptr<const flat_block<T>> block, const value_cell<T>& val) {
+    auto grown = block ? block->grow_front(&val, &val + 1) : nullptr;
+    if (grown)
+        return grown;
+    auto vals = vector<value_cell<T>>(1, val);
+    if (block)
+        vals.insert(vals.end(), block->begin(), block->end());
+    return make_block<T>(vals.begin(), vals.end(), vals.size(), 0);
+}
+
+template <class T>
+shared_ptr<const flat_block<T>> block_slice(shared_ptr<const flat_block<T>> block, treap_size_t begin, treap_size_t end) {
+    if (begin == 0 && end == block->size())
+        return block;
+    if (begin == end)
+        return nullptr;
+    return block->slice(begin, end);
+}
+
+template <class T>
+shared_ptr<const flat_block<T>> block_concat(shared_ptr<const flat_block<T>> lhs, shared_ptr<const flat_block<T>> rhs) {
+    if (!lhs)
+        return rhs;
+    if (!rhs)
+        return lhs;
+    auto grown = lhs->grow_back(rhs->begin(), rhs->end());
+    if (grown)
+        return grown;
+    grown = rhs->grow_front(lhs->begin(), lhs->end());
+    if (grown)
+        return grown;
+    auto vals = vector<value_cell<T>>(lhs->begin(), lhs->end());
+    vals.insert(vals.end(), rhs->begin(), rhs->end());
+    return make_block<T>(vals.begin(), vals.end());
+}
+
+template <class T>
+node_ptr<T> block_tree(shared_ptr<const flat_block<T>> block) {
+    return block ? build<T>(block->begin(), block->end()) : nullptr;
+}
+
+// cells of block with [begin, end) replaced by [values_begin, values_end)
+template <class T, class TIter>
+vector<value_cell<T>> block_splice(
+    shared_ptr<const flat_block<T>> block,
+    treap_size_t begin,
+    treap_size_t end,
+    TIter values_begin,
+    TIter values_end) {
+
+    auto result = vector<value_cell<T>>();
+    if (block)
+        result.insert(result.end(), block->begin(), block->begin() + begin);
+    result.insert(result.end(), values_begin, values_end);
+    if (block)
+        result.insert(result.end(), block->begin() + end, block->end());
+    return result;
+}
+
 #ifdef PYTHON
 #ifdef DEBUG
 void debug_pyobj(PyObject *obj) {
@@ -318,32 +843,641 @@ void py_decref(PyObject *obj) {
 }
 
 template <class T>
-void py_node_incref(shared_ptr<const node<T>> nd) {
+void py_node_incref(node_ptr<T> nd) {
     py_incref(reinterpret_cast<PyObject*>(nd->val()));
 }
 
 template <class T>
-void py_node_decref(shared_ptr<const node<T>> nd) {
+void py_node_decref(node_ptr<T> nd) {
     py_decref(reinterpret_cast<PyObject*>(nd->val()));
 }
 #endif
 
+template <class T>
+void append_values(node_ptr<T> t, vector<value_cell<T>>& result) {
+    if (t) {
+        append_values(t->left(), result);
+        result.push_back(t->cell());
+        append_values(t->right(), result);
+    }
+}
+
+template <class T>
+const value_cell<T>& cell_at_position(node_ptr<T> t, treap_size_t index) {
+    while (t->left()->size() != index) {
+        if (index < t->left()->size()) {
+            t = t->left();
+        }
+        else {
+            index -= t->left()->size() + 1;
+            t = t->right();
+        }
+    }
+    return t->cell();
+}
+
+template <class T>
+const T& value_at(node_ptr<T> t, treap_size_t index) {
+    return cell_at_position(t, index).get();
+}
+
+// copies the path down to index only; the shape of the tree is kept
+template <class T>
+node_ptr<T> set_at_position(node_ptr<T> t, treap_size_t index, const value_cell<T>& val) {
+    if (index < t->left()->size())
+        return make_node<T>(t->cell(), set_at_position(t->left(), index, val), t->right());
+    if (index > t->left()->size())
+        return make_node<T>(t->cell(), t->left(), set_at_position(t->right(), index - t->left()->size() - 1, val));
+    return make_node<T>(val, t->left(), t->right());
+}
+
+template <class T>
+node_ptr<T> erase_at_position(node_ptr<T> t, treap_size_t index) {
+    if (index < t->left()->size())
+        return make_node<T>(t->cell(), erase_at_position(t->left(), index), t->right());
+    if (index > t->left()->size())
+        return make_node<T>(t->cell(), t->left(), erase_at_position(t->right(), index - t->left()->size() - 1));
+    return merge(t->left(), t->right());
+}
+
+#ifndef TREAP_ARENA
+// One chunk of memory handed out slot by slot to allocate_shared. Every
+// node's control block keeps the slab alive, so the chunk is released
+// together with the last of its nodes: a single node kept by an edited
+// version pins the whole chunk, and slots of nodes freed earlier are not
+// reused.
+struct slab {
+    char* data = nullptr;
+    size_t slot_size = 0;
+    size_t capacity;
+    size_t next_slot = 0;
+
+    slab(size_t count) : capacity(count) { }
+    ~slab() { ::operator delete(data); }
+};
+
+template <class U>
+class slab_allocator {
+public:
+    typedef U value_type;
+
+    slab_allocator(shared_ptr<slab> s) : _Slab(s) { }
+    template <class V>
+    slab_allocator(const slab_allocator<V>& rhs) : _Slab(rhs._Slab) { }
+
+    // one node per call, at the slot node_slab chose
+    U* allocate(size_t n) {
+        if (n != 1 || _Slab->next_slot >= _Slab->capacity)
+            throw bad_alloc();
+        if (!_Slab->data) {
+            _Slab->slot_size = sizeof(U);
+            _Slab->data = static_cast<char*>(::operator new(_Slab->capacity * sizeof(U)));
+        }
+        return reinterpret_cast<U*>(_Slab->data + _Slab->next_slot * _Slab->slot_size);
+    }
+
+    void deallocate(U*, size_t) { }
+
+    template <class V>
+    const bool operator==(const slab_allocator<V>& rhs) const { return _Slab == rhs._Slab; }
+    template <class V>
+    const bool operator!=(const slab_allocator<V>& rhs) const { return _Slab != rhs._Slab; }
+
+    shared_ptr<slab> _Slab;
+};
+#endif
+
+// creates nodes at chosen positions of one contiguous allocation
+template <class T>
+class node_slab {
+public:
+#ifdef TREAP_ARENA
+    node_slab(size_t count) : _First(node_arena<T>::instance().reserve(count)) { }
+#else
+    node_slab(size_t count) : _Slab(make_shared<slab>(count)) { }
+#endif
+
+    template <class... Args>
+    node_ptr<T> make(size_t slot, Args&&... args) {
+#ifdef TREAP_ARENA
+        return arena_ptr<T>::make_at(_First + slot, std::forward<Args>(args)...);
+#else
+        _Slab->next_slot = slot;
+        return allocate_shared<const node<T>>(slab_allocator<node<T>>(_Slab), std::forward<Args>(args)...);
+#endif
+    }
+private:
+#ifdef TREAP_ARENA
+    uint32_t _First;
+#else
+    shared_ptr<slab> _Slab;
+#endif
+};
+
+// appends the positions of the range tree over [begin, end), truncated to
+// depth levels, in van Emde Boas order
+inline void veb_order(treap_size_t begin, treap_size_t end, treap_size_t depth, vector<treap_size_t>& order) {
+    if (begin >= end)
+        return;
+    if (depth == 1) {
+        order.push_back(begin + (end - begin) / 2);
+        return;
+    }
+    treap_size_t top = depth / 2;
+    veb_order(begin, end, top, order);
+    // the subtrees hanging below the top part, from left to right
+    auto ranges = vector<pair<treap_size_t, treap_size_t>>(1, make_pair(begin, end));
+    for (treap_size_t level = 0; level < top; level++) {
+        auto next = vector<pair<treap_size_t, treap_size_t>>();
+        for (const auto& range : ranges) {
+            if (range.first >= range.second)
+                continue;
+            treap_size_t mid = range.first + (range.second - range.first) / 2;
+            next.push_back(make_pair(range.first, mid));
+            next.push_back(make_pair(mid + 1, range.second));
+        }
+        ranges.swap(next);
+    }
+    for (const auto& range : ranges)
+        veb_order(range.first, range.second, depth - top, order);
+}
+
+template <class T>
+node_ptr<T> build_balanced(
+    const vector<value_cell<T>>& cells, 
+    const vector<treap_size_t>& slots, 
+    node_slab<T>& memory, 
+    treap_size_t begin, 
+    treap_size_t end) {
+
+    if (begin >= end)
+        return nullptr;
+    treap_size_t mid = begin + (end - begin) / 2;
+    auto left = build_balanced(cells, slots, memory, begin, mid);
+    auto right = build_balanced(cells, slots, memory, mid + 1, end);
+    return memory.make(slots[mid], cells[mid], left, right);
+}
+
+// copies a tree into a perfectly balanced one whose nodes are laid out
+// contiguously in van Emde Boas order
+template <class T>
+node_ptr<T> compact(node_ptr<T> tree) {
+    if (!tree)
+        return nullptr;
+    auto cells = vector<value_cell<T>>();
+    append_values(tree, cells);
+    treap_size_t size = cells.size(), depth = 0;
+    while ((treap_size_t(1) << depth) - 1 < size)
+        depth++;
+    auto order = vector<treap_size_t>();
+    veb_order(0, size, depth, order);
+    auto slots = vector<treap_size_t>(size);
+    for (treap_size_t i = 0; i < size; i++)
+        slots[order[i]] = i;
+    auto memory = node_slab<T>(size);
+    return build_balanced(cells, slots, memory, 0, size);
+}
+
+// Position of the first element i such that pred holds for the summary of
+// the elements up to and including i, or the size of the tree if there is
+// none; pred must be monotone. acc is the summary of everything before the
+// tree on entry, and of everything before the result on exit.
+template <class T, class Pred>
+treap_size_t find_by_prefix(node_ptr<T> t, const Pred& pred, typename summary_traits<T>::type& acc) {
+    typedef summary_traits<T> traits;
+    treap_size_t pos = 0;
+    while (t) {
+        auto with_left = t->left() ? traits::combine(acc, t->left()->summary()) : acc;
+        if (t->left() && pred(with_left)) {
+            t = t->left();
+            continue;
+        }
+        auto with_node = traits::combine(with_left, traits::of(t->val()));
+        pos += t->left()->size();
+        if (pred(with_node)) {
+            acc = with_left;
+            return pos;
+        }
+        acc = with_node;
+        pos++;
+        t = t->right();
+    }
+    return pos;
+}
+
+// summary of the elements [begin, end) of the tree
+template <class T>
+typename summary_traits<T>::type range_summary(node_ptr<T> t, treap_size_t begin, treap_size_t end) {
+    typedef summary_traits<T> traits;
+    if (!t || begin >= end)
+        return traits::identity();
+    // subtrees outside the range are skipped, so only two root-to-leaf paths are visited
+    if (end <= 0 || begin >= t->size())
+        return traits::identity();
+    if (begin <= 0 && end >= t->size())
+        return t->summary();
+    treap_size_t left_size = t->left()->size();
+    auto result = range_summary(t->left(), begin, end);
+    if (begin <= left_size && left_size < end)
+        result = traits::combine(result, traits::of(t->val()));
+    return traits::combine(result, range_summary(t->right(), begin - left_size - 1, end - left_size - 1));
+}
+
+// The same for a flat block. The whole block is reduced first in a tight
+// loop the compiler can vectorize, and only the block that holds the answer
+// is walked element by element.
+template <class T, class Pred>
+treap_size_t find_by_prefix(shared_ptr<const flat_block<T>> block, const Pred& pred, typename summary_traits<T>::type& acc) {
+    typedef summary_traits<T> traits;
+    treap_size_t size = block->size();
+    auto total = acc;
+    for (treap_size_t i = 0; i < size; i++)
+        total = traits::combine(total, traits::of((*block)[i]));
+    if (!pred(total)) {
+        acc = total;
+        return size;
+    }
+    for (treap_size_t i = 0; i < size; i++) {
+        auto next = traits::combine(acc, traits::of((*block)[i]));
+        if (pred(next))
+            return i;
+        acc = next;
+    }
+    return size;
+}
+
+template <class T>
+typename summary_traits<T>::type range_summary(shared_ptr<const flat_block<T>> block, treap_size_t begin, treap_size_t end) {
+    typedef summary_traits<T> traits;
+    auto result = traits::identity();
+    for (treap_size_t i = max(begin, treap_size_t(0)); i < min(end, block->size()); i++)
+        result = traits::combine(result, traits::of((*block)[i]));
+    return result;
+}
+
+inline uint64_t mix_hash(uint64_t x) {
+    x += 0x9e3779b97f4a7c15ULL;
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+    return x ^ (x >> 31);
+}
+
+// Remembers the nodes it has created, so that building a node with an
+// equal value and the very same children returns the existing one.
+template <class T, class Hash = std::hash<T>, class KeyEqual = equal_to<T>>
+class hash_cons_table {
+public:
+    hash_cons_table(const Hash& hash = Hash(), const KeyEqual& equal = KeyEqual()) : _Hash(hash), _Equal(equal) { }
+
+    const Hash& hash_function() const { return _Hash; }
+
+    node_ptr<T> intern(const value_cell<T>& cell, node_ptr<T> left, node_ptr<T> right) {
+        auto key = mix_hash(_Hash(cell.get()) ^ mix_hash(reinterpret_cast<uintptr_t>(left.get()) ^ mix_hash(reinterpret_cast<uintptr_t>(right.get()))));
+        auto range = _Nodes.equal_range(key);
+        for (auto current = range.first; current != range.second; ++current) {
+            const auto& nd = current->second;
+            if (nd->left() == left && nd->right() == right && _Equal(nd->val(), cell.get()))
+                return nd;
+        }
+        auto result = make_node<T>(cell, left, right);
+        _Nodes.insert(make_pair(key, result));
+        return result;
+    }
+
+    const size_t size() const { return _Nodes.size(); }
+
+    // forgets the nodes no longer used by any tree
+    void collect() {
+        bool removed = true;
+        while (removed) {
+            removed = false;
+            for (auto current = _Nodes.begin(); current != _Nodes.end(); ) {
+                if (current->second.use_count() == 1) {
+                    current = _Nodes.erase(current);
+                    removed = true;
+                }
+                else {
+                    ++current;
+                }
+            }
+        }
+    }
+private:
+    Hash _Hash;
+    KeyEqual _Equal;
+    unordered_multimap<uint64_t, node_ptr<T>> _Nodes;
+};
+
+// Builds the treap whose shape is fully determined by the contents: the
+// priority of an element is a hash of its value and position, so equal
+// sequences always get identical trees. With a table, identical subtrees
+// are shared with the ones built before.
+template <class T, class Hash, class TTable>
+node_ptr<T> canonical_build(const vector<value_cell<T>>& cells, const Hash& hash, TTable* table) {
+    treap_size_t size = cells.size();
+    auto priority = vector<uint64_t>(size);
+    for (treap_size_t i = 0; i < size; i++)
+        priority[i] = mix_hash(hash(cells[i].get()) ^ mix_hash(i));
+    auto left = vector<treap_size_t>(size, -1), right = vector<treap_size_t>(size, -1);
+    auto path = vector<treap_size_t>();
+    for (treap_size_t i = 0; i < size; i++) {
+        treap_size_t last = -1;
+        while (!path.empty() && priority[path.back()] < priority[i]) {
+            last = path.back();
+            path.pop_back();
+        }
+        left[i] = last;
+        if (!path.empty())
+            right[path.back()] = i;
+        path.push_back(i);
+    }
+    function<node_ptr<T>(treap_size_t)> make = [&](treap_size_t i) -> node_ptr<T> {
+        if (i < 0)
+            return nullptr;
+        auto l = make(left[i]);
+        auto r = make(right[i]);
+        return table ? table->intern(cells[i], l, r) : make_node<T>(cells[i], l, r);
+    };
+    return path.empty() ? nullptr : make(path[0]);
+}
+
+// copy of tree with every value replaced by f(value); a subtree reachable
+// along several paths is mapped once and stays shared in the copy
+template <class T, class F>
+node_ptr<T> map_shared(node_ptr<T> tree, F& f, unordered_map<const node<T>*, node_ptr<T>>& memo) {
+    if (!tree)
+        return nullptr;
+    auto found = memo.find(tree.get());
+    if (found != memo.end())
+        return found->second;
+    auto left = map_shared(tree->left(), f, memo);
+    auto right = map_shared(tree->right(), f, memo);
+    return memo[tree.get()] = make_node<T>(f(tree->val()), left, right);
+}
+
+template <class T, class F>
+shared_ptr<const flat_block<T>> map_block(shared_ptr<const flat_block<T>> block, F& f) {
+    auto vals = vector<value_cell<T>>();
+    for (treap_size_t i = 0; i < block->size(); i++)
+        vals.push_back(value_cell<T>(f((*block)[i])));
+    return make_block<T>(vals.begin(), vals.end());
+}
+
+// Memory held by a set of versions. Bytes cover nodes, flat blocks and
+// out-of-line values with their allocation headers, but not memory the
+// values themselves point to.
+struct memory_usage {
+    size_t objects = 0; // distinct nodes, blocks and out-of-line values
+    size_t bytes = 0;
+    size_t shared_bytes = 0; // reachable from more than one version
+    // per version: what dropping only this version would free
+    vector<size_t> exclusive_bytes;
+    // per version: reachable from it and from some other version; only filled on request
+    vector<size_t> version_shared_bytes;
+};
+
+template <class T>
+class memory_walk {
+public:
+    memory_walk(size_t versions) : _Version(0) {
+        _Usage.exclusive_bytes.resize(versions);
+    }
+
+    // first pass: every object is owned by the version that reached it first,
+    // or becomes shared once another version reaches it too
+    void own(size_t version, shared_ptr<const flat_block<T>> head, node_ptr<T> root, shared_ptr<const flat_block<T>> tail) {
+        _Version = version;
+        own_block(head);
+        own_tree(root);
+        own_block(tail);
+    }
+
+    // optional second pass: shared bytes reachable from one version, walking
+    // only what that version reaches
+    size_t shared_reach(shared_ptr<const flat_block<T>> head, node_ptr<T> root, shared_ptr<const flat_block<T>> tail) {
+        _Seen.clear();
+        return shared_reach_block(head) + shared_reach_tree(root) + shared_reach_block(tail);
+    }
+
+    memory_usage result() {
+        for (const auto& entry : _Objects) {
+            _Usage.objects++;
+            _Usage.bytes += entry.second.bytes;
+            if (entry.second.owner == shared)
+                _Usage.shared_bytes += entry.second.bytes;
+            else
+                _Usage.exclusive_bytes[entry.second.owner] += entry.second.bytes;
+        }
+        return _Usage;
+    }
+
+    memory_usage& usage() { return _Usage; }
+
+    static size_t node_bytes() {
+#ifdef TREAP_ARENA
+        return sizeof(node<T>) + sizeof(uint32_t);
+#else
+        return sizeof(node<T>) + 2 * sizeof(long); // make_shared control block
+#endif
+    }
+
+    // a block together with storage of its own for size cells
+    static size_t block_bytes(treap_size_t size) {
+        return view_bytes() + storage_bytes(size);
+    }
+
+    static size_t value_bytes() {
+        return value_cell<T>::is_inline ? 0 : sizeof(T) + 2 * sizeof(long);
+    }
+private:
+    static const size_t shared = size_t(-1);
+
+    static size_t view_bytes() {
+        return sizeof(flat_block<T>) + 2 * sizeof(long);
+    }
+
+    static size_t storage_bytes(treap_size_t capacity) {
+        return sizeof(block_storage<T>) + capacity * sizeof(value_cell<T>) + 2 * sizeof(long);
+    }
+
+    struct object {
+        size_t owner;
+        size_t bytes;
+    };
+
+    // whether the object's children still have to be visited
+    bool own_object(const void* ptr, size_t bytes) {
+        auto found = _Objects.find(ptr);
+        if (found == _Objects.end()) {
+            _Objects[ptr] = object{ _Version, bytes };
+            return true;
+        }
+        if (found->second.owner == _Version || found->second.owner == shared)
+            return false;
+        found->second.owner = shared;
+        return true;
+    }
+
+    void own_value(const T& val) {
+        if (!value_cell<T>::is_inline)
+            own_object(&val, value_bytes());
+    }
+
+    void own_block(shared_ptr<const flat_block<T>> block) {
+        if (!block || !own_object(block.get(), view_bytes()))
+            return;
+        own_object(block->storage(), storage_bytes(block->storage()->capacity()));
+        for (treap_size_t i = 0; i < block->size(); i++)
+            own_value((*block)[i]);
+    }
+
+    void own_tree(node_ptr<T> tree) {
+        if (!tree || !own_object(tree.get(), node_bytes()))
+            return;
+        own_value(tree->val());
+        own_tree(tree->left());
+        own_tree(tree->right());
+    }
+
+    size_t shared_reach_object(const void* ptr) {
+        if (!_Seen.insert(ptr).second)
+            return 0;
+        const auto& found = _Objects[ptr];
+        return found.owner == shared ? found.bytes : 0;
+    }
+
+    size_t shared_reach_block(shared_ptr<const flat_block<T>> block) {
+        if (!block || _Seen.count(block.get()))
+            return 0;
+        size_t result = shared_reach_object(block.get()) + shared_reach_object(block->storage());
+        for (treap_size_t i = 0; i < block->size() && !value_cell<T>::is_inline; i++)
+            result += shared_reach_object(&(*block)[i]);
+        return result;
+    }
+
+    size_t shared_reach_tree(node_ptr<T> tree) {
+        if (!tree || _Seen.count(tree.get()))
+            return 0;
+        size_t result = shared_reach_object(tree.get());
+        if (!value_cell<T>::is_inline)
+            result += shared_reach_object(&tree->val());
+        return result + shared_reach_tree(tree->left()) + shared_reach_tree(tree->right());
+    }
+
+    size_t _Version;
+    unordered_map<const void*, object> _Objects;
+    unordered_set<const void*> _Seen;
+    memory_usage _Usage;
+};
+
+// Walks a version in order as whole subtrees, ranges of flat blocks and
+// single values, so that two walks can step over the parts both share.
+template <class T>
+class piece_walk {
+public:
+    piece_walk(shared_ptr<const flat_block<T>> head, node_ptr<T> root, shared_ptr<const flat_block<T>> tail) {
+        push_block(tail);
+        push_tree(root);
+        push_block(head);
+    }
+
+    const bool done() const { return _Pieces.empty(); }
+    const bool at_tree() const { return bool(top().tree); }
+    const bool at_value() const { return !top().tree; }
+    const treap_size_t piece_size() const { return at_tree() ? top().tree->size() : top().end - top().begin; }
+
+    // same subtree, or same block range, at the front of both walks
+    const bool shares_front(const piece_walk& rhs) const {
+        if (at_tree() || rhs.at_tree())
+            return top().tree == rhs.top().tree;
+        return top().block && rhs.top().block && &top().block->cell(top().begin) == &rhs.top().block->cell(rhs.top().begin);
+    }
+
+    const T& value() const { return top().block ? (*top().block)[top().begin] : top().tree_val->val(); }
+
+    // replaces the subtree at the front by its left subtree, root value and right subtree
+    void expand() {
+        auto tree = top().tree;
+        _Pieces.pop_back();
+        push_tree(tree->right());
+        _Pieces.push_back(piece{ nullptr, tree, nullptr, 0, 1 });
+        push_tree(tree->left());
+    }
+
+    void skip(treap_size_t count) {
+        if (at_tree() || top().end - top().begin == count)
+            _Pieces.pop_back();
+        else
+            _Pieces.back().begin += count;
+    }
+private:
+    struct piece {
+        node_ptr<T> tree;     // a whole subtree
+        node_ptr<T> tree_val; // or the value of a single node
+        shared_ptr<const flat_block<T>> block; // or a range of a block
+        treap_size_t begin, end;
+    };
+
+    const piece& top() const { return _Pieces.back(); }
+
+    void push_tree(node_ptr<T> tree) {
+        if (tree)
+            _Pieces.push_back(piece{ tree, nullptr, nullptr, 0, 0 });
+    }
+
+    void push_block(shared_ptr<const flat_block<T>> block) {
+        if (block)
+            _Pieces.push_back(piece{ nullptr, nullptr, block, 0, block->size() });
+    }
+
+    vector<piece> _Pieces;
+};
+
 template <class T>
 class node_iterator : public std::iterator<forward_iterator_tag, T> {
 public:
-    node_iterator(shared_ptr<const node<T>> root = nullptr) {
+    node_iterator(node_ptr<T> root = nullptr) {
+        auto current = root;
+        while (current) {
+            _Path.push_back(current);
+            _Right.push_back(false);
+            current = current->left();
+        }
+        if (!_Right.empty()) 
+            _Right[0] = true;
+    }
+
+    // walks the cells of head, then the tree, then the cells of tail
+    node_iterator(shared_ptr<const flat_block<T>> head, node_ptr<T> root, shared_ptr<const flat_block<T>> tail) : node_iterator(root) {
+        _Block = head ? head : _Path.empty() ? tail : nullptr;
+        _Next = _Block == tail ? nullptr : tail;
+    }
+
+    node_iterator(node_ptr<T> root, treap_size_t pos) {
+        if (pos >= root->size())
+            return;
         auto current = root;
+        bool right = true;
         while (current) {
             _Path.push_back(current);
-            _Right.push_back(false);
-            current = current->left();
+            _Right.push_back(right);
+            treap_size_t left_size = current->left()->size();
+            if (pos == left_size)
+                break;
+            if (pos < left_size) {
+                current = current->left();
+                right = false;
+            }
+            else {
+                pos -= left_size + 1;
+                current = current->right();
+                right = true;
+            }
         }
-        if (!_Right.empty()) 
-            _Right[0] = true;
     }
 
     const T& operator*() const {
-        const auto& result = _Path.back()->val(); 
+        const auto& result = _Block ? (*_Block)[_Index] : _Path.back()->val(); 
 #ifdef PYTHON
         if (std::is_same<T,PyObject*>::value) {
             py_incref(reinterpret_cast<PyObject*>(result));
@@ -353,6 +1487,15 @@ public:
     }
 
     const node_iterator& operator++() {
+        if (_Block) {
+            if (++_Index < _Block->size())
+                return *this;
+            _Block = nullptr;
+            _Index = 0;
+            if (_Path.empty())
+                next_block();
+            return *this;
+        }
         if (_Path.back()->right()) {
             _Path.push_back(_Path.back()->right());
             _Right.push_back(true);
@@ -371,6 +1514,8 @@ public:
                 _Right.pop_back();
             }
         }
+        if (_Path.empty())
+            next_block();
         return *this;
     }
 
@@ -381,6 +1526,8 @@ public:
     }
 
     const bool operator==(const node_iterator& rhs) const {
+        if (_Block != rhs._Block || _Index != rhs._Index || _Next != rhs._Next)
+            return false;
         if (_Path.size() != rhs._Path.size()) 
             return false;
         for (int i = 0; i < _Path.size(); i++) 
@@ -394,12 +1541,21 @@ public:
     }
 
     const bool is_end() const {
-        return _Path.empty();
+        return _Path.empty() && !_Block;
+    }
+
+private:
+    void next_block() {
+        _Block = _Next;
+        _Next = nullptr;
     }
 
 public:
-    vector<shared_ptr<const node<T>>> _Path;
+    vector<node_ptr<T>> _Path;
     vector<bool> _Right;
+    // the block being walked, at _Index, and the tail block still to come
+    shared_ptr<const flat_block<T>> _Block, _Next;
+    treap_size_t _Index = 0;
 };
 
 } // namespace impl
@@ -409,34 +1565,86 @@ using namespace impl;
 template <class T>
 class treap;
 
+template <class T>
+class persistent_treap_view;
+
+template <class T>
+class treap_cursor;
+
+template <class T>
+struct treap_edit;
+
+template <class T>
+class shm_snapshot;
+
 template <class T>
 class persistent_treap {
 public:
     typedef node_iterator<T> const_iterator;
 
-    persistent_treap(shared_ptr<const node<T>> root = nullptr); // v
+    // End operations are absorbed by head/tail blocks of at most this many
+    // elements. Each one copies its block, so costs O(buffer_capacity); a block
+    // that overflows or runs dry moves only half a block to or from the tree,
+    // so the tree is touched once per buffer_capacity / 2 operations at most.
+    static const treap_size_t buffer_capacity = 32;
+    // sequences of at most this many elements have no tree and live in the head block alone
+    static const treap_size_t small_threshold = buffer_capacity;
+
+    persistent_treap(node_ptr<T> root = nullptr); // v
     persistent_treap(const persistent_treap& rhs); // v
     persistent_treap(const treap<T>& rhs) : persistent_treap(rhs.freeze()) { }
     const persistent_treap& operator=(const persistent_treap& rhs) {
+        _Head = rhs._Head;
         _Root = rhs._Root;
+        _Tail = rhs._Tail;
+        _Hash.store(rhs._Hash.load(memory_order_relaxed), memory_order_relaxed);
+        return *this;
     }
 
     template <class TIter>
     persistent_treap(TIter begin, TIter end); 
 
-    const treap_size_t size() const { return _Root->size(); } // v
+    const treap_size_t size() const { return _Head->size() + _Root->size() + _Tail->size(); } // v
+
+    persistent_treap<T> push_back(const T& x) const { return push_back_cell(value_cell<T>(x)); } // v
+    persistent_treap<T> push_back(T&& x) const { return push_back_cell(value_cell<T>(std::move(x))); }
+    persistent_treap<T> push_front(const T& x) const { return push_front_cell(value_cell<T>(x)); }
+    persistent_treap<T> push_front(T&& x) const { return push_front_cell(value_cell<T>(std::move(x))); }
 
-    persistent_treap<T> push_back(const T& x) const; // v
-    persistent_treap<T> push_front(const T& x) const; 
+    template <class... Args>
+    persistent_treap<T> emplace_back(Args&&... args) const { 
+        return push_back_cell(value_cell<T>(emplace_tag(), std::forward<Args>(args)...)); 
+    }
+    template <class... Args>
+    persistent_treap<T> emplace_front(Args&&... args) const { 
+        return push_front_cell(value_cell<T>(emplace_tag(), std::forward<Args>(args)...)); 
+    }
     persistent_treap<T> pop_back() const; // v
     persistent_treap<T> pop_front() const;
     
     persistent_treap<T> erase(treap_size_t pos) const;
     persistent_treap<T> erase(treap_size_t begin, treap_size_t end) const;
-    persistent_treap<T> insert(treap_size_t pos, const T& val) const;
+    persistent_treap<T> insert(treap_size_t pos, const T& val) const { return insert_cell(pos, value_cell<T>(val)); }
+    persistent_treap<T> insert(treap_size_t pos, T&& val) const { return insert_cell(pos, value_cell<T>(std::move(val))); }
     persistent_treap<T> insert(treap_size_t pos, const persistent_treap<T>& t) const;
+
+    template <class... Args>
+    persistent_treap<T> emplace(treap_size_t pos, Args&&... args) const { 
+        return insert_cell(pos, value_cell<T>(emplace_tag(), std::forward<Args>(args)...)); 
+    }
+
     pair<persistent_treap<T>, persistent_treap<T>> split(treap_size_t pos) const;
 
+    // applies all edits at once; positions refer to this version and edited ranges must not overlap
+    persistent_treap<T> apply_batch(vector<treap_edit<T>> edits) const;
+
+    // stable sort of [begin, end), elements outside the range stay in place
+    template <class Compare = less<T>>
+    persistent_treap<T> sort(treap_size_t begin, treap_size_t end, Compare comp = Compare()) const;
+
+    // moves [middle, end) in front of [begin, middle), like std::rotate
+    persistent_treap<T> rotate(treap_size_t begin, treap_size_t middle, treap_size_t end) const;
+
     const bool empty() const;
 
     const T& operator[](treap_size_t index) const;
@@ -444,13 +1652,53 @@ public:
     const T& back() const;
     const T& front() const;
 
-    const bool is(const persistent_treap<T>& rhs) {
-        return _Root == rhs._Root;
+    const bool is(const persistent_treap<T>& rhs) const {
+        return _Root == rhs._Root && _Head == rhs._Head && _Tail == rhs._Tail;
     }
 
     persistent_treap<T> slice(treap_size_t begin, treap_size_t end) const;
 
-    persistent_treap<T> set(treap_size_t index, const T& val) const;
+    // The summaries below are those of summary_traits<T>, which the nodes
+    // cache; S only delays instantiation until a summary is asked for.
+
+    // first position whose prefix summary satisfies pred, or size(); see impl::find_by_prefix
+    template <class Pred, class S = summary_traits<T>>
+    treap_size_t find_by_prefix(const Pred& pred) const;
+
+    template <class S = summary_traits<T>>
+    typename S::type summary(treap_size_t begin, treap_size_t end) const;
+    template <class S = summary_traits<T>>
+    typename S::type summary() const { return summary<S>(0, size()); }
+
+    // same shape with every value replaced by f(value), f called once per stored value
+    template <class F>
+    persistent_treap<T> map_values(F f) const {
+        auto memo = unordered_map<const node<T>*, node_ptr<T>>();
+        return persistent_treap<T>(map_block(_Head, f), map_shared(_Root, f, memo), map_block(_Tail, f));
+    }
+
+    // balanced copy stored contiguously, for long-lived read-mostly snapshots;
+    // versions edited from it keep the whole allocation while they share a node
+    persistent_treap<T> compact() const { return persistent_treap<T>(impl::compact(tree())); }
+
+    // rebuilt with the content-determined shape, sharing subtrees through table if given
+    persistent_treap<T> canonicalize() const;
+    template <class TTable>
+    persistent_treap<T> canonicalize(TTable& table) const;
+
+    template <class TIter>
+    static persistent_treap<T> canonical(TIter begin, TIter end);
+    template <class TIter, class TTable>
+    static persistent_treap<T> canonical(TIter begin, TIter end, TTable& table);
+
+    // lazy slices: nothing is copied until the view is materialized
+    persistent_treap_view<T> view() const { return persistent_treap_view<T>(*this); }
+    persistent_treap_view<T> view(treap_size_t begin, treap_size_t end) const { return view().slice(begin, end); }
+
+    treap_cursor<T> cursor(treap_size_t pos = 0) const { return treap_cursor<T>(*this, pos); }
+
+    persistent_treap<T> set(treap_size_t index, const T& val) const { return set_cell(index, value_cell<T>(val)); }
+    persistent_treap<T> set(treap_size_t index, T&& val) const { return set_cell(index, value_cell<T>(std::move(val))); }
 
     template <class T1>
     friend ostream& operator<<(ostream& ostr, const persistent_treap<T1>& persistent_treap);
@@ -459,10 +1707,28 @@ public:
     friend persistent_treap<T1> operator+(const persistent_treap<T1>& lhs, const persistent_treap<T1>& rhs);
 
     template <class T1>
-    friend persistent_treap<T1> operator*(const persistent_treap<T1>& lhs, int n);
+    friend persistent_treap<T1> operator*(const persistent_treap<T1>& lhs, treap_size_t n);
+
+    template <class T1, class Compare>
+    friend persistent_treap<T1> merge_sorted(const persistent_treap<T1>& lhs, const persistent_treap<T1>& rhs, const Compare& comp);
+
+    template <class T1>
+    friend memory_usage measure_memory(const vector<persistent_treap<T1>>& versions, bool per_version_shared);
+
+    // Position of the first element where the two versions differ, or the
+    // smaller size if one is a prefix of the other. Subtrees and blocks the
+    // versions share at the same position are skipped without comparing.
+    template <class KeyEqual>
+    const treap_size_t mismatch(const persistent_treap& rhs, const KeyEqual& eq) const;
+    const treap_size_t mismatch(const persistent_treap& rhs) const { return mismatch(rhs, equal_to<T>()); }
+
+    // polynomial hash of the values in order, the same for any shape; computed
+    // once per version, so use a single hash function with each version
+    template <class Hash = std::hash<T>>
+    const uint64_t hash(const Hash& hash = Hash()) const;
 
     const bool operator==(const persistent_treap& rhs) const {
-        return std::equal(cbegin(), cend(), rhs.cbegin(), rhs.cend());
+        return size() == rhs.size() && mismatch(rhs) == size();
     }
 
     const bool operator!=(const persistent_treap& rhs) const {
@@ -470,7 +1736,10 @@ public:
     }
 
     const bool operator<(const persistent_treap& rhs) const {
-        return std::lexicographical_compare(cbegin(), cend(), rhs.cbegin(), rhs.cend());
+        treap_size_t pos = mismatch(rhs);
+        if (pos == size() || pos == rhs.size())
+            return size() < rhs.size();
+        return cell_at(pos).get() < rhs.cell_at(pos).get();
     }
 
     const bool operator>(const persistent_treap& rhs) const {
@@ -485,9 +1754,9 @@ public:
         return operator==(rhs) || operator<(rhs);
     }
 
-    const treap_size_t height() const { return _Root->height(); } 
+    const treap_size_t height() const { return tree()->height(); } 
 
-    const_iterator cbegin() const { return const_iterator(_Root); }
+    const_iterator cbegin() const { return const_iterator(_Head, _Root, _Tail); }
     const_iterator cend() const { return const_iterator(nullptr); }
 
     void debug_print() const {
@@ -496,7 +1765,7 @@ public:
     void debug_print(const string& name) const {
 #ifdef DEBUG
         cerr << name << "[" << size() << "]: ";
-        structural_print(_Root);
+        structural_print(tree());
         cerr << endl;
 #endif
     }
@@ -512,6 +1781,9 @@ public:
     treap<T> thaw() const {
         return treap<T>(*this);
     }
+
+    friend class persistent_treap_view<T>;
+    friend class shm_snapshot<T>;
     
     ~persistent_treap() {
 #ifdef DEBUG
@@ -520,79 +1792,416 @@ public:
 #endif
     }
 private:
-    shared_ptr<const node<T>> _Root;
+    persistent_treap(
+        shared_ptr<const flat_block<T>> head, 
+        node_ptr<T> root, 
+        shared_ptr<const flat_block<T>> tail
+        ) : _Head(head), _Root(root), _Tail(tail) { 
+        flatten_if_small();
+    }
+
+    const bool is_flat() const { return !_Root && !_Tail; }
+    void flatten_if_small();
+    // flat if there are few enough cells, a freshly built tree otherwise
+    static persistent_treap<T> from_cells(const vector<value_cell<T>>& cells);
+
+    // the whole sequence as a single tree, with the buffers merged in; only
+    // for operations that visit every element anyway
+    node_ptr<T> tree() const;
+
+    // The pieces between consecutive cuts, which must be sorted. The buffers
+    // are sliced and the tree split in one descent, so unlike tree() no
+    // buffered cell is turned into a node; operator+ puts pieces back together.
+    vector<persistent_treap<T>> cut(const vector<treap_size_t>& cuts) const;
+
+    void append_cells(vector<value_cell<T>>& cells) const;
+
+    const value_cell<T>& cell_at(treap_size_t index) const;
+
+    persistent_treap<T> push_back_cell(const value_cell<T>& x) const;
+    persistent_treap<T> push_front_cell(const value_cell<T>& x) const;
+    persistent_treap<T> insert_cell(treap_size_t pos, const value_cell<T>& val) const;
+    persistent_treap<T> set_cell(treap_size_t index, const value_cell<T>& val) const;
+
+    shared_ptr<const flat_block<T>> _Head;
+    node_ptr<T> _Root;
+    shared_ptr<const flat_block<T>> _Tail;
+    // 0 until hash() is first called; versions are shared between threads, and
+    // a race only computes the same value twice, so relaxed order is enough
+    mutable atomic<uint64_t> _Hash{ 0 };
 }; 
 
 
+// replaces the range [begin, end) of a version by values
+template <class T>
+struct treap_edit {
+    treap_size_t begin, end;
+    persistent_treap<T> values;
+
+    static treap_edit insert(treap_size_t pos, const T& val) {
+        return treap_edit{ pos, pos, persistent_treap<T>().push_back(val) };
+    }
+    static treap_edit insert(treap_size_t pos, const persistent_treap<T>& t) {
+        return treap_edit{ pos, pos, t };
+    }
+    static treap_edit erase(treap_size_t pos) {
+        return treap_edit{ pos, pos + 1, persistent_treap<T>() };
+    }
+    static treap_edit erase(treap_size_t begin, treap_size_t end) {
+        return treap_edit{ begin, end, persistent_treap<T>() };
+    }
+    static treap_edit set(treap_size_t pos, const T& val) {
+        return treap_edit{ pos, pos + 1, persistent_treap<T>().push_back(val) };
+    }
+};
+
+template <class T>
+const treap_size_t persistent_treap<T>::buffer_capacity;
+
+template <class T>
+const treap_size_t persistent_treap<T>::small_threshold;
+
 template <class T>
-persistent_treap<T>::persistent_treap(shared_ptr<const node<T>> root) : _Root(root) { 
+persistent_treap<T>::persistent_treap(node_ptr<T> root) : _Root(root) { 
+    flatten_if_small();
 }
 
 template <class T>
-persistent_treap<T>::persistent_treap(const persistent_treap& rhs) : _Root(rhs._Root) {
+persistent_treap<T>::persistent_treap(const persistent_treap& rhs) : _Head(rhs._Head), _Root(rhs._Root), _Tail(rhs._Tail), _Hash(rhs._Hash.load(memory_order_relaxed)) {
 }
     
 template <class T>
 template <class TIter>
 persistent_treap<T>::persistent_treap(TIter begin, TIter end) : _Root(build<T, TIter>(begin, end)) { 
+    flatten_if_small();
+}
+
+template <class T>
+template <class KeyEqual>
+const treap_size_t persistent_treap<T>::mismatch(const persistent_treap& rhs, const KeyEqual& eq) const {
+    if (is(rhs))
+        return size();
+    auto lhs_walk = piece_walk<T>(_Head, _Root, _Tail);
+    auto rhs_walk = piece_walk<T>(rhs._Head, rhs._Root, rhs._Tail);
+    treap_size_t pos = 0;
+    while (!lhs_walk.done() && !rhs_walk.done()) {
+        if (lhs_walk.shares_front(rhs_walk)) {
+            treap_size_t count = min(lhs_walk.piece_size(), rhs_walk.piece_size());
+            lhs_walk.skip(count);
+            rhs_walk.skip(count);
+            pos += count;
+        }
+        // open the larger subtree first, so that shared subtrees line up
+        else if (lhs_walk.at_tree() && (rhs_walk.at_value() || lhs_walk.piece_size() >= rhs_walk.piece_size()))
+            lhs_walk.expand();
+        else if (rhs_walk.at_tree())
+            rhs_walk.expand();
+        else {
+            if (!eq(lhs_walk.value(), rhs_walk.value()))
+                return pos;
+            lhs_walk.skip(1);
+            rhs_walk.skip(1);
+            pos++;
+        }
+    }
+    return pos;
+}
+
+template <class T>
+template <class Hash>
+const uint64_t persistent_treap<T>::hash(const Hash& hash) const {
+    uint64_t cached = _Hash.load(memory_order_relaxed);
+    if (cached)
+        return cached;
+    uint64_t result = size();
+    for (auto walk = piece_walk<T>(_Head, _Root, _Tail); !walk.done(); ) {
+        if (walk.at_tree()) {
+            walk.expand();
+            continue;
+        }
+        result = result * 0x9e3779b97f4a7c15ULL + mix_hash(hash(walk.value()));
+        walk.skip(1);
+    }
+    // 0 marks a hash that is not computed yet
+    result = result ? result : 1;
+    _Hash.store(result, memory_order_relaxed);
+    return result;
+}
+
+template <class T>
+void persistent_treap<T>::flatten_if_small() {
+    if (is_flat() || size() > small_threshold)
+        return;
+    auto cells = vector<value_cell<T>>();
+    append_cells(cells);
+    _Head = make_block<T>(cells.begin(), cells.end());
+    _Root = nullptr;
+    _Tail = nullptr;
+}
+
+template <class T>
+persistent_treap<T> persistent_treap<T>::from_cells(const vector<value_cell<T>>& cells) {
+    if (treap_size_t(cells.size()) <= small_threshold)
+        return persistent_treap<T>(make_block<T>(cells.begin(), cells.end()), nullptr, nullptr);
+    return persistent_treap<T>(build<T>(cells.begin(), cells.end()));
+}
+
+template <class T>
+node_ptr<T> persistent_treap<T>::tree() const {
+    if (!_Head && !_Tail)
+        return _Root;
+    return merge(merge(block_tree(_Head), _Root), block_tree(_Tail));
+}
+
+template <class T>
+vector<persistent_treap<T>> persistent_treap<T>::cut(const vector<treap_size_t>& cuts) const {
+    treap_size_t head = _Head->size(), root = _Root->size(), tail = _Tail->size();
+    auto clamp = [](treap_size_t pos, treap_size_t size) { return min(max(pos, treap_size_t(0)), size); };
+    auto root_cuts = vector<treap_size_t>();
+    for (treap_size_t pos : cuts)
+        root_cuts.push_back(clamp(pos - head, root));
+    auto roots = vector<node_ptr<T>>();
+    split_many(_Root, root_cuts.begin(), root_cuts.end(), 0, roots);
+    auto pieces = vector<persistent_treap<T>>();
+    for (size_t i = 0; i <= cuts.size(); i++) {
+        treap_size_t begin = i > 0 ? cuts[i - 1] : 0, end = i < cuts.size() ? cuts[i] : size();
+        pieces.push_back(persistent_treap<T>(
+            block_slice(_Head, clamp(begin, head), clamp(end, head)),
+            roots[i],
+            block_slice(_Tail, clamp(begin - head - root, tail), clamp(end - head - root, tail))));
+    }
+    return pieces;
 }
 
 template <class T>
-persistent_treap<T> persistent_treap<T>::push_back(const T& x) const {
-    return (*this) + persistent_treap<T>(make_shared<node<T>>(x));
+void persistent_treap<T>::append_cells(vector<value_cell<T>>& cells) const {
+    if (_Head)
+        cells.insert(cells.end(), _Head->begin(), _Head->end());
+    append_values(_Root, cells);
+    if (_Tail)
+        cells.insert(cells.end(), _Tail->begin(), _Tail->end());
 }
 
 template <class T>
-persistent_treap<T> persistent_treap<T>::push_front(const T& x) const {
-    return persistent_treap<T>(make_shared<node<T>>(x)) + (*this);
+persistent_treap<T> persistent_treap<T>::push_back_cell(const value_cell<T>& x) const {
+    checked_size_add(size(), 1);
+    if (is_flat() && size() < small_threshold)
+        return persistent_treap<T>(block_push_back(_Head, x), nullptr, nullptr);
+    if (_Tail->size() < buffer_capacity)
+        return persistent_treap<T>(_Head, _Root, block_push_back(_Tail, x));
+    // keep half of the tail, so that popping right after does not split the tree again
+    auto flushed = block_tree(block_slice(_Tail, 0, buffer_capacity / 2));
+    auto kept = block_push_back(block_slice(_Tail, buffer_capacity / 2, _Tail->size()), x);
+    return persistent_treap<T>(_Head, merge(_Root, flushed), kept);
+}
+
+template <class T>
+persistent_treap<T> persistent_treap<T>::push_front_cell(const value_cell<T>& x) const {
+    checked_size_add(size(), 1);
+    if (_Head->size() < buffer_capacity)
+        return persistent_treap<T>(block_push_front(_Head, x), _Root, _Tail);
+    auto flushed = block_tree(block_slice(_Head, _Head->size() - buffer_capacity / 2, _Head->size()));
+    auto kept = block_push_front(block_slice(_Head, 0, _Head->size() - buffer_capacity / 2), x);
+    return persistent_treap<T>(kept, merge(flushed, _Root), _Tail);
 }
 
 template <class T>
 persistent_treap<T> persistent_treap<T>::pop_back() const {
-    return erase(size() - 1);
+    if (_Tail)
+        return persistent_treap<T>(_Head, _Root, block_slice(_Tail, 0, _Tail->size() - 1));
+    if (_Root) {
+        // refill the tail with the last half block of the tree
+        auto splitted = impl::split(_Root, max(_Root->size() - buffer_capacity / 2, treap_size_t(0)));
+        auto chunk = vector<value_cell<T>>();
+        append_values(splitted.second, chunk);
+        return persistent_treap<T>(_Head, splitted.first, make_block<T>(chunk.begin(), chunk.end() - 1));
+    }
+    return persistent_treap<T>(block_slice(_Head, 0, _Head->size() - 1), nullptr, nullptr);
 }
 
 template <class T>
 persistent_treap<T> persistent_treap<T>::pop_front() const {
-    return erase(0);
+    if (_Head)
+        return persistent_treap<T>(block_slice(_Head, 1, _Head->size()), _Root, _Tail);
+    if (_Root) {
+        // refill the head with the first half block of the tree
+        auto splitted = impl::split(_Root, min(_Root->size(), buffer_capacity / 2));
+        auto chunk = vector<value_cell<T>>();
+        append_values(splitted.first, chunk);
+        return persistent_treap<T>(make_block<T>(chunk.begin() + 1, chunk.end()), splitted.second, _Tail);
+    }
+    return persistent_treap<T>(nullptr, nullptr, block_slice(_Tail, 1, _Tail->size()));
 }
 
 template <class T>
 persistent_treap<T> persistent_treap<T>::erase(treap_size_t pos) const {
-    return erase(pos, pos+1);
+    if (is_flat())
+        return erase(pos, pos+1);
+    auto none = (const value_cell<T>*)nullptr;
+    treap_size_t head = _Head->size(), root = _Root->size();
+    if (pos < head) {
+        auto cells = block_splice(_Head, pos, pos + 1, none, none);
+        return persistent_treap<T>(make_block<T>(cells.begin(), cells.end()), _Root, _Tail);
+    }
+    if (pos < head + root)
+        return persistent_treap<T>(_Head, erase_at_position(_Root, pos - head), _Tail);
+    auto cells = block_splice(_Tail, pos - head - root, pos - head - root + 1, none, none);
+    return persistent_treap<T>(_Head, _Root, make_block<T>(cells.begin(), cells.end()));
 }
 
 template <class T>
 persistent_treap<T> persistent_treap<T>::erase(treap_size_t begin, treap_size_t end) const {
-    auto splitted1 = impl::split(_Root, end);
-    auto splitted2 = impl::split(splitted1.first, begin);
-    auto result = persistent_treap<T>(merge(splitted2.first, splitted1.second));
-    return result;
+    if (is_flat()) {
+        auto none = (const value_cell<T>*)nullptr;
+        return from_cells(block_splice(_Head, begin, end, none, none));
+    }
+    auto pieces = cut({ begin, end });
+    return pieces[0] + pieces[2];
 }
 
 template <class T>
-persistent_treap<T> persistent_treap<T>::insert(treap_size_t pos, const T& val) const {
-    return insert(pos, persistent_treap<T>(make_shared<node<T>>(val)));
+persistent_treap<T> persistent_treap<T>::insert_cell(treap_size_t pos, const value_cell<T>& val) const {
+    checked_size_add(size(), 1);
+    if (is_flat())
+        return from_cells(block_splice(_Head, pos, pos, &val, &val + 1));
+    treap_size_t head = _Head->size(), root = _Root->size(), tail = _Tail->size();
+    if (pos > head && pos < head + root) {
+        auto splitted = impl::split(_Root, pos - head);
+        return persistent_treap<T>(_Head, join(splitted.first, val, splitted.second), _Tail);
+    }
+    if (pos <= head && head < buffer_capacity) {
+        auto cells = block_splice(_Head, pos, pos, &val, &val + 1);
+        return persistent_treap<T>(make_block<T>(cells.begin(), cells.end()), _Root, _Tail);
+    }
+    if (pos >= head + root && tail < buffer_capacity) {
+        auto cells = block_splice(_Tail, pos - head - root, pos - head - root, &val, &val + 1);
+        return persistent_treap<T>(_Head, _Root, make_block<T>(cells.begin(), cells.end()));
+    }
+    return insert(pos, persistent_treap<T>(make_block<T>(&val, &val + 1), nullptr, nullptr));
 }
 
 template <class T>
 persistent_treap<T> persistent_treap<T>::insert(treap_size_t pos, const persistent_treap<T>& t) const {
-    auto splitted1 = impl::split(_Root, pos);
-    auto result = persistent_treap<T>(merge(splitted1.first, merge(t._Root, splitted1.second)));
-    return result;
+    if (t.empty())
+        return *this;
+    checked_size_add(size(), t.size());
+    if (is_flat() && t.is_flat() && size() + t.size() <= small_threshold)
+        return from_cells(block_splice(_Head, pos, pos, t._Head->begin(), t._Head->end()));
+    auto pieces = cut({ pos });
+    return pieces[0] + t + pieces[1];
 }
 
 template <class T>
 pair<persistent_treap<T>, persistent_treap<T>> persistent_treap<T>::split(treap_size_t pos) const {
-    auto splitted1 = impl::split(_Root, pos);
-    auto result1 = persistent_treap<T>(splitted1.first);
-    auto result2 = persistent_treap<T>(splitted1.second);
-    return make_pair(result1, result2);
+    auto pieces = cut({ pos });
+    return make_pair(pieces[0], pieces[1]);
+}
+
+template <class T>
+persistent_treap<T> persistent_treap<T>::apply_batch(vector<treap_edit<T>> edits) const {
+    stable_sort(edits.begin(), edits.end(), [](const treap_edit<T>& lhs, const treap_edit<T>& rhs) {
+        return lhs.begin < rhs.begin || (lhs.begin == rhs.begin && lhs.end < rhs.end);
+    });
+    auto cuts = vector<treap_size_t>();
+    treap_size_t new_size = size();
+    for (const auto& edit : edits) {
+        cuts.push_back(edit.begin);
+        cuts.push_back(edit.end);
+        new_size = checked_size_add(new_size - (edit.end - edit.begin), edit.values.size());
+    }
+    auto pieces = cut(cuts);
+    // pieces alternate between kept ranges and edited ranges
+    auto result = pieces[0];
+    for (size_t i = 0; i < edits.size(); i++)
+        result = result + edits[i].values + pieces[2 * i + 2];
+    return result;
+}
+
+template <class T>
+template <class Compare>
+persistent_treap<T> persistent_treap<T>::sort(treap_size_t begin, treap_size_t end, Compare comp) const {
+    auto pieces = cut({ begin, end });
+    auto cells = vector<value_cell<T>>();
+    cells.reserve(end - begin);
+    pieces[1].append_cells(cells);
+    parallel_sort<T>(cells.begin(), cells.end(), comp);
+    return pieces[0] + from_cells(cells) + pieces[2];
+}
+
+template <class T>
+persistent_treap<T> persistent_treap<T>::rotate(treap_size_t begin, treap_size_t middle, treap_size_t end) const {
+    auto pieces = cut({ begin, middle, end });
+    return pieces[0] + pieces[2] + pieces[1] + pieces[3];
+}
+
+template <class T>
+template <class Pred, class S>
+treap_size_t persistent_treap<T>::find_by_prefix(const Pred& pred) const {
+    static_assert(is_same<S, summary_traits<T>>::value, "find_by_prefix works on the cached summary_traits<T> only");
+    auto acc = S::identity();
+    treap_size_t pos = 0;
+    if (_Head) {
+        pos = impl::find_by_prefix(_Head, pred, acc);
+        if (pos < _Head->size())
+            return pos;
+    }
+    pos += impl::find_by_prefix(_Root, pred, acc);
+    if (pos < _Head->size() + _Root->size() || !_Tail)
+        return pos;
+    return pos + impl::find_by_prefix(_Tail, pred, acc);
+}
+
+template <class T>
+template <class S>
+typename S::type persistent_treap<T>::summary(treap_size_t begin, treap_size_t end) const {
+    static_assert(is_same<S, summary_traits<T>>::value, "summary works on the cached summary_traits<T> only");
+    auto result = S::identity();
+    if (_Head)
+        result = range_summary(_Head, begin, end);
+    begin -= _Head->size();
+    end -= _Head->size();
+    result = S::combine(result, range_summary(_Root, begin, end));
+    if (_Tail)
+        result = S::combine(result, range_summary(_Tail, begin - _Root->size(), end - _Root->size()));
+    return result;
+}
+
+template <class T>
+persistent_treap<T> persistent_treap<T>::canonicalize() const {
+    auto cells = vector<value_cell<T>>();
+    append_cells(cells);
+    return persistent_treap<T>(canonical_build(cells, std::hash<T>(), (hash_cons_table<T>*)nullptr));
+}
+
+template <class T>
+template <class TTable>
+persistent_treap<T> persistent_treap<T>::canonicalize(TTable& table) const {
+    auto cells = vector<value_cell<T>>();
+    append_cells(cells);
+    return persistent_treap<T>(canonical_build(cells, table.hash_function(), &table));
+}
+
+template <class T>
+template <class TIter>
+persistent_treap<T> persistent_treap<T>::canonical(TIter begin, TIter end) {
+    auto cells = vector<value_cell<T>>();
+    for (; begin != end; ++begin)
+        cells.push_back(value_cell<T>(*begin));
+    return persistent_treap<T>(canonical_build(cells, std::hash<T>(), (hash_cons_table<T>*)nullptr));
+}
+
+template <class T>
+template <class TIter, class TTable>
+persistent_treap<T> persistent_treap<T>::canonical(TIter begin, TIter end, TTable& table) {
+    auto cells = vector<value_cell<T>>();
+    for (; begin != end; ++begin)
+        cells.push_back(value_cell<T>(*begin));
+    return persistent_treap<T>(canonical_build(cells, table.hash_function(), &table));
 }
 
 template <class T>
 const bool persistent_treap<T>::empty() const {
-    return _Root == nullptr;
+    return !_Head && !_Root && !_Tail;
 }
     
 template <class T>
@@ -601,9 +2210,7 @@ const T& persistent_treap<T>::operator[](treap_size_t index) const {
     debug_method("operator[]");
     debug_print();
 #endif
-    auto splitted1 = impl::split(_Root, index);
-    auto splitted2 = impl::split(splitted1.second, 1);
-    const auto& result = splitted2.first->val();
+    const auto& result = cell_at(index).get();
 #ifdef PYTHON
     if (std::is_same<T,PyObject*>::value) {
         py_incref(reinterpret_cast<PyObject*>(result));
@@ -616,28 +2223,55 @@ const T& persistent_treap<T>::operator[](treap_size_t index) const {
     return result;
 }
 
+template <class T>
+const value_cell<T>& persistent_treap<T>::cell_at(treap_size_t index) const {
+    if (index < _Head->size())
+        return _Head->cell(index);
+    index -= _Head->size();
+    if (index < _Root->size())
+        return cell_at_position(_Root, index);
+    return _Tail->cell(index - _Root->size());
+}
+
+template <class T>
+const T& persistent_treap<T>::back() const {
+    return operator[](size() - 1);
+}
+
+template <class T>
+const T& persistent_treap<T>::front() const {
+    return operator[](0);
+}
+
 template <class T>
 persistent_treap<T> persistent_treap<T>::slice(treap_size_t begin, treap_size_t end) const {
-    auto splitted1 = impl::split(_Root, end);
-    auto splitted2 = impl::split(splitted1.first, begin);
-    auto result = splitted2.second;
-    return result;
+    if (begin >= end)
+        return persistent_treap<T>();
+    return cut({ begin, end })[1];
 }
 
 template <class T>
-persistent_treap<T> persistent_treap<T>::set(treap_size_t index, const T& val) const {
-    auto splitted1 = impl::split(_Root, index);
-    auto splitted2 = impl::split(splitted1.second, 1);
-    auto result = persistent_treap<T>(merge(splitted1.first, merge(make_shared<const node<T>>(val), splitted2.second)));
-    return result;
+persistent_treap<T> persistent_treap<T>::set_cell(treap_size_t index, const value_cell<T>& val) const {
+    if (is_flat())
+        return from_cells(block_splice(_Head, index, index + 1, &val, &val + 1));
+    treap_size_t head = _Head->size(), root = _Root->size();
+    if (index < head) {
+        auto cells = block_splice(_Head, index, index + 1, &val, &val + 1);
+        return persistent_treap<T>(make_block<T>(cells.begin(), cells.end()), _Root, _Tail);
+    }
+    if (index < head + root)
+        return persistent_treap<T>(_Head, set_at_position(_Root, index - head, val), _Tail);
+    auto cells = block_splice(_Tail, index - head - root, index - head - root + 1, &val, &val + 1);
+    return persistent_treap<T>(_Head, _Root, make_block<T>(cells.begin(), cells.end()));
 }
 
 template <class T1>
 ostream& operator<<(ostream& ostr, const persistent_treap<T1>& rhs) {
-    if (rhs._Root) {
-        ostr << (persistent_treap<T1>(rhs._Root->left()));
-        ostr << rhs._Root->val() << ' ';
-        ostr << (persistent_treap<T1>(rhs._Root->right()));
+    auto root = rhs.tree();
+    if (root) {
+        ostr << (persistent_treap<T1>(root->left()));
+        ostr << root->val() << ' ';
+        ostr << (persistent_treap<T1>(root->right()));
     }
     return ostr;
 }
@@ -649,11 +2283,52 @@ persistent_treap<T1> operator+(const persistent_treap<T1>& lhs, const persistent
     lhs.debug_print("lhs");
     rhs.debug_print("rhs");
 #endif
-    return persistent_treap<T1>(merge(lhs._Root, rhs._Root));
+    if (lhs.empty())
+        return rhs;
+    if (rhs.empty())
+        return lhs;
+    checked_size_add(lhs.size(), rhs.size());
+    if (lhs.is_flat() && rhs.is_flat() && lhs.size() + rhs.size() <= persistent_treap<T1>::small_threshold)
+        return persistent_treap<T1>::from_cells(block_splice(lhs._Head, lhs.size(), lhs.size(), rhs._Head->begin(), rhs._Head->end()));
+    // a short side joins the buffer next to it, so no cell becomes a node
+    if (rhs.is_flat() && lhs._Tail->size() + rhs.size() <= persistent_treap<T1>::buffer_capacity)
+        return persistent_treap<T1>(lhs._Head, lhs._Root, block_concat(lhs._Tail, rhs._Head));
+    if (lhs.is_flat() && lhs.size() + rhs._Head->size() <= persistent_treap<T1>::buffer_capacity)
+        return persistent_treap<T1>(block_concat(lhs._Head, rhs._Head), rhs._Root, rhs._Tail);
+    auto middle = merge(merge(lhs._Root, block_tree(lhs._Tail)), merge(block_tree(rhs._Head), rhs._Root));
+    return persistent_treap<T1>(lhs._Head, middle, rhs._Tail);
+}
+
+// merges two sorted versions; on equal elements those of lhs go first
+template <class T1, class Compare>
+persistent_treap<T1> merge_sorted(const persistent_treap<T1>& lhs, const persistent_treap<T1>& rhs, const Compare& comp) {
+    checked_size_add(lhs.size(), rhs.size());
+    return persistent_treap<T1>(impl::merge_sorted(lhs.tree(), rhs.tree(), comp));
+}
+
+template <class T1>
+persistent_treap<T1> merge_sorted(const persistent_treap<T1>& lhs, const persistent_treap<T1>& rhs) {
+    return merge_sorted(lhs, rhs, less<T1>());
+}
+
+// Walks the structure of all versions once. version_shared_bytes costs one
+// more walk per version over what it reaches, so it is off by default.
+template <class T1>
+memory_usage measure_memory(const vector<persistent_treap<T1>>& versions, bool per_version_shared = false) {
+    auto walk = memory_walk<T1>(versions.size());
+    for (size_t i = 0; i < versions.size(); i++)
+        walk.own(i, versions[i]._Head, versions[i]._Root, versions[i]._Tail);
+    if (per_version_shared) {
+        for (const auto& version : versions)
+            walk.usage().version_shared_bytes.push_back(walk.shared_reach(version._Head, version._Root, version._Tail));
+    }
+    return walk.result();
 }
 
 template <class T1>
-persistent_treap<T1> operator*(const persistent_treap<T1>& lhs, int n) {
+persistent_treap<T1> operator*(const persistent_treap<T1>& lhs, treap_size_t n) {
+    if (n > 0 && lhs.size() > numeric_limits<treap_size_t>::max() / n)
+        throw length_error("persistent_treap: size exceeds treap_size_t");
     if (n == 0)
         return persistent_treap<T1>();
     else if (n % 2)
@@ -665,10 +2340,262 @@ persistent_treap<T1> operator*(const persistent_treap<T1>& lhs, int n) {
 }
 
 template <class T1>
-persistent_treap<T1> operator*(int n, const persistent_treap<T1>& lhs) {
+persistent_treap<T1> operator*(treap_size_t n, const persistent_treap<T1>& lhs) {
     return lhs * n;
 }
 
+template <class T>
+class persistent_treap_view {
+private:
+    // a range [begin, end) of either a tree or a flat block
+    struct segment {
+        node_ptr<T> tree;
+        shared_ptr<const flat_block<T>> block;
+        treap_size_t begin, end;
+    };
+
+    struct segment_list {
+        vector<segment> segments;
+        vector<treap_size_t> offsets; // offsets[i] is the view position of segments[i].begin
+        treap_size_t size = 0;
+
+        void append(const segment& seg) {
+            if (seg.begin == seg.end)
+                return;
+            segments.push_back(seg);
+            offsets.push_back(size);
+            size += seg.end - seg.begin;
+        }
+    };
+
+public:
+    class const_iterator : public std::iterator<forward_iterator_tag, T> {
+    public:
+        const_iterator(shared_ptr<const segment_list> segments = nullptr, treap_size_t index = 0) 
+            : _Segments(segments), _Index(index), _Pos(0) {
+            enter();
+        }
+
+        const T& operator*() const {
+            const auto& seg = _Segments->segments[_Index];
+            if (seg.tree)
+                return *_Inner;
+            const auto& result = (*seg.block)[_Pos];
+#ifdef PYTHON
+            if (std::is_same<T,PyObject*>::value) {
+                py_incref(reinterpret_cast<PyObject*>(result));
+            }
+#endif
+            return result;
+        }
+
+        const const_iterator& operator++() {
+            const auto& seg = _Segments->segments[_Index];
+            if (seg.tree)
+                ++_Inner;
+            if (++_Pos == seg.end) {
+                _Index++;
+                enter();
+            }
+            return *this;
+        }
+
+        const_iterator operator++(int) {
+            auto res = *this;
+            operator++();
+            return res;
+        }
+
+        const bool operator==(const const_iterator& rhs) const {
+            if (is_end() || rhs.is_end())
+                return is_end() == rhs.is_end();
+            return _Segments == rhs._Segments && _Index == rhs._Index && _Pos == rhs._Pos;
+        }
+
+        const bool operator!=(const const_iterator& rhs) const {
+            return !operator==(rhs);
+        }
+
+        const bool is_end() const {
+            return !_Segments || _Index >= treap_size_t(_Segments->segments.size());
+        }
+
+    private:
+        void enter() {
+            if (is_end())
+                return;
+            const auto& seg = _Segments->segments[_Index];
+            _Pos = seg.begin;
+            if (seg.tree)
+                _Inner = node_iterator<T>(seg.tree, seg.begin);
+        }
+
+        shared_ptr<const segment_list> _Segments;
+        treap_size_t _Index;
+        treap_size_t _Pos;
+        node_iterator<T> _Inner;
+    };
+
+    persistent_treap_view() : _Segments(make_shared<const segment_list>()) { }
+    persistent_treap_view(const persistent_treap<T>& t);
+
+    const treap_size_t size() const { return _Segments->size; }
+    const bool empty() const { return size() == 0; }
+
+    const T& operator[](treap_size_t index) const;
+    const T& at(treap_size_t index) const { return operator[](index); }
+
+    persistent_treap_view<T> slice(treap_size_t begin, treap_size_t end) const;
+
+    // builds a real treap, path copying only at the boundaries of the view
+    persistent_treap<T> materialize() const;
+
+    template <class T1>
+    friend persistent_treap_view<T1> operator+(const persistent_treap_view<T1>& lhs, const persistent_treap_view<T1>& rhs);
+
+    const_iterator cbegin() const { return const_iterator(_Segments, 0); }
+    const_iterator cend() const { return const_iterator(); }
+
+private:
+    persistent_treap_view(shared_ptr<const segment_list> segments) : _Segments(segments) { }
+
+    shared_ptr<const segment_list> _Segments;
+};
+
+template <class T>
+persistent_treap_view<T>::persistent_treap_view(const persistent_treap<T>& t) {
+    auto segments = make_shared<segment_list>();
+    segments->append(segment{ nullptr, t._Head, 0, t._Head->size() });
+    segments->append(segment{ t._Root, nullptr, 0, t._Root->size() });
+    segments->append(segment{ nullptr, t._Tail, 0, t._Tail->size() });
+    _Segments = segments;
+}
+
+template <class T>
+const T& persistent_treap_view<T>::operator[](treap_size_t index) const {
+    const auto& offsets = _Segments->offsets;
+    auto i = upper_bound(offsets.begin(), offsets.end(), index) - offsets.begin() - 1;
+    const auto& seg = _Segments->segments[i];
+    auto pos = seg.begin + index - offsets[i];
+    const auto& result = seg.tree ? value_at(seg.tree, pos) : (*seg.block)[pos];
+#ifdef PYTHON
+    if (std::is_same<T,PyObject*>::value) {
+        py_incref(reinterpret_cast<PyObject*>(result));
+    }
+#endif
+    return result;
+}
+
+template <class T>
+persistent_treap_view<T> persistent_treap_view<T>::slice(treap_size_t begin, treap_size_t end) const {
+    auto segments = make_shared<segment_list>();
+    for (size_t i = 0; i < _Segments->segments.size(); i++) {
+        auto seg = _Segments->segments[i];
+        auto offset = _Segments->offsets[i] - seg.begin;
+        seg.begin = max(seg.begin, begin - offset);
+        seg.end = min(seg.end, end - offset);
+        if (seg.begin < seg.end)
+            segments->append(seg);
+    }
+    return persistent_treap_view<T>(segments);
+}
+
+template <class T>
+persistent_treap<T> persistent_treap_view<T>::materialize() const {
+    node_ptr<T> result = nullptr;
+    for (const auto& seg : _Segments->segments) {
+        node_ptr<T> piece;
+        if (seg.tree) {
+            piece = seg.tree;
+            if (seg.end != piece->size())
+                piece = impl::split(piece, seg.end).first;
+            if (seg.begin != 0)
+                piece = impl::split(piece, seg.begin).second;
+        }
+        else {
+            piece = build<T>(seg.block->begin() + seg.begin, seg.block->begin() + seg.end);
+        }
+        result = merge(result, piece);
+    }
+    return persistent_treap<T>(result);
+}
+
+template <class T1>
+persistent_treap_view<T1> operator+(const persistent_treap_view<T1>& lhs, const persistent_treap_view<T1>& rhs) {
+    checked_size_add(lhs.size(), rhs.size());
+    auto segments = make_shared<typename persistent_treap_view<T1>::segment_list>(*lhs._Segments);
+    for (const auto& seg : rhs._Segments->segments)
+        segments->append(seg);
+    return persistent_treap_view<T1>(segments);
+}
+
+// Editing position inside a version. The sequence is kept split at the
+// cursor, so edits and short moves only touch the buffered ends of the two
+// halves; commit() joins them back with a single merge.
+template <class T>
+class treap_cursor {
+public:
+    treap_cursor(const persistent_treap<T>& t = persistent_treap<T>(), treap_size_t pos = 0) {
+        auto splitted = t.split(pos);
+        _Before = splitted.first;
+        _After = splitted.second;
+    }
+
+    const treap_size_t position() const { return _Before.size(); }
+    const treap_size_t size() const { return _Before.size() + _After.size(); }
+    const bool at_begin() const { return _Before.empty(); }
+    const bool at_end() const { return _After.empty(); }
+
+    void move(treap_size_t offset);
+    void seek(treap_size_t pos) { move(pos - position()); }
+
+    // element at position() + offset
+    const T& get(treap_size_t offset = 0) const {
+        if (offset < -_Before.size() || offset >= _After.size())
+            throw out_of_range("treap_cursor: offset out of range");
+        return offset < 0 ? _Before[_Before.size() + offset] : _After[offset];
+    }
+
+    // inserts before the cursor, like typing
+    void insert(const T& val) { _Before = _Before.push_back(val); }
+    void insert(T&& val) { _Before = _Before.push_back(std::move(val)); }
+    void insert(const persistent_treap<T>& t) { _Before = _Before + t; }
+    void set(const T& val) { _After = after_front().pop_front().push_front(val); }
+    void set(T&& val) { _After = after_front().pop_front().push_front(std::move(val)); }
+    void erase_before() {
+        if (at_begin())
+            throw out_of_range("treap_cursor: nothing before the cursor");
+        _Before = _Before.pop_back();
+    }
+    void erase_after() { _After = after_front().pop_front(); }
+
+    persistent_treap<T> commit() const { return _Before + _After; }
+
+private:
+    const persistent_treap<T>& after_front() const {
+        if (at_end())
+            throw out_of_range("treap_cursor: nothing after the cursor");
+        return _After;
+    }
+
+    persistent_treap<T> _Before, _After;
+};
+
+// moves the offset elements between the halves with one split and one concat
+template <class T>
+void treap_cursor<T>::move(treap_size_t offset) {
+    if (offset > 0) {
+        auto splitted = _After.split(offset);
+        _Before = _Before + splitted.first;
+        _After = splitted.second;
+    }
+    else if (offset < 0) {
+        auto splitted = _Before.split(_Before.size() + offset);
+        _Before = splitted.first;
+        _After = splitted.second + _After;
+    }
+}
+
 template <class T>
 class treap {
 public:
@@ -678,9 +2605,13 @@ public:
         operator T() { 
             return _Tree[_Pos];
         }
-        const T& operator=(const T& rhs) {
+        setter& operator=(const T& rhs) {
             _Tree = _Tree.set(_Pos, rhs);
-            return rhs;
+            return *this;
+        }
+        setter& operator=(T&& rhs) {
+            _Tree = _Tree.set(_Pos, std::move(rhs));
+            return *this;
         }
     private:
         persistent_treap<T>& _Tree;
@@ -735,9 +2666,23 @@ public:
     void push_back(const T& x) {
         _Impl = _Impl.push_back(x);
     }
+    void push_back(T&& x) {
+        _Impl = _Impl.push_back(std::move(x));
+    }
     void push_front(const T& x) {
         _Impl = _Impl.push_front(x);
     }
+    void push_front(T&& x) {
+        _Impl = _Impl.push_front(std::move(x));
+    }
+    template <class... Args>
+    void emplace_back(Args&&... args) {
+        _Impl = _Impl.emplace_back(std::forward<Args>(args)...);
+    }
+    template <class... Args>
+    void emplace_front(Args&&... args) {
+        _Impl = _Impl.emplace_front(std::forward<Args>(args)...);
+    }
     void pop_back() {
         _Impl = _Impl.pop_back();
     }
@@ -754,9 +2699,26 @@ public:
     void insert(treap_size_t pos, const T& val) {
         _Impl = _Impl.insert(pos, val);
     }
+    void insert(treap_size_t pos, T&& val) {
+        _Impl = _Impl.insert(pos, std::move(val));
+    }
+    template <class... Args>
+    void emplace(treap_size_t pos, Args&&... args) {
+        _Impl = _Impl.emplace(pos, std::forward<Args>(args)...);
+    }
     void insert(treap_size_t pos, const treap<T>& t) {
         _Impl = _Impl.insert(pos, t._Impl);
     }
+    void apply_batch(const vector<treap_edit<T>>& edits) {
+        _Impl = _Impl.apply_batch(edits);
+    }
+    template <class Compare = less<T>>
+    void sort(treap_size_t begin, treap_size_t end, Compare comp = Compare()) {
+        _Impl = _Impl.sort(begin, end, comp);
+    }
+    void rotate(treap_size_t begin, treap_size_t middle, treap_size_t end) {
+        _Impl = _Impl.rotate(begin, middle, end);
+    }
     
     const bool empty() const {
         return _Impl.empty();
@@ -788,6 +2750,10 @@ public:
         return treap<T>(_Impl.slice(begin, end));
     }
 
+    persistent_treap_view<T> view(treap_size_t begin, treap_size_t end) const {
+        return _Impl.view(begin, end);
+    }
+
     const bool is(const treap<T>& rhs) const {
         return _Impl.is(rhs._Impl);
     }
@@ -799,7 +2765,7 @@ public:
     friend treap<T1> operator+(const treap<T1>& lhs, const treap<T1>& rhs);
 
     template <class T1>
-    friend treap<T1> operator*(const treap<T1>& lhs, int n);
+    friend treap<T1> operator*(const treap<T1>& lhs, treap_size_t n);
 
     const bool operator==(const treap& rhs) const {
         return _Impl == rhs._Impl;
@@ -831,6 +2797,15 @@ public:
     const_iterator cbegin() const { return _Impl.cbegin(); }
     const_iterator cend() const { return _Impl.cend(); }
 
+    template <class Pred>
+    treap_size_t find_by_prefix(const Pred& pred) const {
+        return _Impl.find_by_prefix(pred);
+    }
+
+    persistent_treap<T> freeze_compact() const {
+        return _Impl.compact();
+    }
+
     const persistent_treap<T>& freeze() const {
         return _Impl;
     }
@@ -849,12 +2824,12 @@ treap<T1> operator+(const treap<T1>& lhs, const treap<T1>& rhs) {
 }
 
 template <class T1>
-treap<T1> operator*(const treap<T1>& lhs, int n) {
+treap<T1> operator*(const treap<T1>& lhs, treap_size_t n) {
     return treap<T1>(lhs._Impl * n);
 }
 
 template <class T1>
-treap<T1> operator*(int n, const treap<T1>& rhs) {
+treap<T1> operator*(treap_size_t n, const treap<T1>& rhs) {
     return rhs * n;
 }
 
@@ -0,0 +1,285 @@
+#ifndef _NODE_ARENA_H_
+#define _NODE_ARENA_H_
+
+#include <atomic>
+#include <cstdint>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <thread>
+#include <vector>
+#include <sys/mman.h>
+#include <unistd.h>
+
+using namespace std;
+
+namespace impl {
+
+template <class T>
+class node;
+
+// Nodes of one element type live in large blocks and are addressed by
+// 32-bit indices; reference counts are kept in a side table. Index 0 is
+// the null handle. Every thread keeps a cache of free indices, so that
+// allocating and releasing take the mutex only once per cache_batch nodes.
+template <class T>
+class node_arena {
+public:
+    // never destroyed, since handles in static objects may outlive it at exit
+    static node_arena& instance() {
+        static node_arena* arena = new node_arena();
+        return *arena;
+    }
+
+    template <class... Args>
+    uint32_t allocate(Args&&... args) {
+        auto cache = local_cache();
+        auto single = vector<uint32_t>();
+        auto& free = cache ? *cache : single;
+        if (free.empty()) {
+            lock_guard<mutex> lock(_Mutex);
+            refill(free, cache ? cache_batch : 1);
+        }
+        uint32_t index = free.back();
+        free.pop_back();
+        try {
+            construct(index, std::forward<Args>(args)...);
+        }
+        catch (...) {
+            give_back(index);
+            throw;
+        }
+        return index;
+    }
+
+    // reserves count consecutive fresh indices, to be filled with construct()
+    uint32_t reserve(uint32_t count) {
+        lock_guard<mutex> lock(_Mutex);
+        if (count > numeric_limits<uint32_t>::max() - _Next)
+            throw bad_alloc();
+        uint32_t first = _Next;
+        _Next += count;
+        for (uint32_t b = first >> block_bits; b <= (_Next - 1) >> block_bits; b++) {
+            if (!_Blocks[b])
+                _Blocks[b] = new block;
+        }
+        return first;
+    }
+
+    template <class... Args>
+    void construct(uint32_t index, Args&&... args) {
+        enter(index);
+        try {
+            new (&slot(index)) node<T>(std::forward<Args>(args)...);
+        }
+        catch (...) {
+            leave(index);
+            throw;
+        }
+        refcount(index).store(1, memory_order_relaxed);
+    }
+
+    void retain(uint32_t index) {
+        if (index)
+            refcount(index).fetch_add(1, memory_order_relaxed);
+    }
+
+    void release(uint32_t index) {
+        if (!index || refcount(index).fetch_sub(1, memory_order_acq_rel) != 1)
+            return;
+        reinterpret_cast<node<T>*>(&slot(index))->~node<T>();
+        leave(index);
+        give_back(index);
+    }
+
+    const long use_count(uint32_t index) const {
+        return index ? refcount(index).load(memory_order_relaxed) : 0;
+    }
+
+    const node<T>* at(uint32_t index) const {
+        return index ? reinterpret_cast<const node<T>*>(&slot(index)) : nullptr;
+    }
+
+    const size_t live_nodes() const {
+        lock_guard<mutex> lock(_Mutex);
+        size_t result = 0;
+        for (uint32_t b = 0; b <= (_Next - 1) >> block_bits; b++)
+            result += _Blocks[b] ? _Blocks[b]->live.load(memory_order_relaxed) & ~trimming : 0;
+        return result;
+    }
+
+    // Hands the pages of blocks without a live node back to the system.
+    // Their free indices stay valid; reusing one faults zeroed pages back in.
+    // Returns the number of blocks trimmed.
+    size_t trim() {
+        lock_guard<mutex> lock(_Mutex);
+        size_t trimmed = 0;
+        const uintptr_t page = sysconf(_SC_PAGESIZE);
+        for (uint32_t b = 0; b <= (_Next - 1) >> block_bits; b++) {
+            uint32_t idle = 0;
+            if (!_Blocks[b] || !_Blocks[b]->live.compare_exchange_strong(idle, trimming, memory_order_acquire))
+                continue;
+            // nodes and refcounts only, never the page holding live
+            auto begin = (reinterpret_cast<uintptr_t>(&_Blocks[b]->nodes[0]) + page - 1) / page * page;
+            auto end = reinterpret_cast<uintptr_t>(&_Blocks[b]->refcounts[0] + (1 << block_bits)) / page * page;
+            if (begin < end && madvise(reinterpret_cast<void*>(begin), end - begin, MADV_DONTNEED) == 0)
+                trimmed++;
+            // entering threads that saw the mark have taken their count back
+            _Blocks[b]->live.fetch_sub(trimming, memory_order_release);
+        }
+        return trimmed;
+    }
+
+private:
+    static const uint32_t block_bits = 16;
+    static const size_t cache_batch = 256;
+    // marks a block whose pages trim() is handing back
+    static const uint32_t trimming = 1u << 31;
+
+    typedef typename aligned_storage<sizeof(node<T>), alignof(node<T>)>::type storage;
+
+    struct block {
+        block() : live(0) { }
+        // nodes constructed in the block, or trimming
+        atomic<uint32_t> live;
+        storage nodes[1 << block_bits];
+        atomic<uint32_t> refcounts[1 << block_bits];
+    };
+
+    // Free indices of the calling thread, handed back to the arena when the
+    // thread exits. nullptr once they have been, for handles released later
+    // by thread_local or static destructors.
+    static vector<uint32_t>* local_cache() {
+        static thread_local bool gone = false;
+        struct cache {
+            vector<uint32_t> free;
+            ~cache() {
+                gone = true;
+                auto& arena = instance();
+                lock_guard<mutex> lock(arena._Mutex);
+                arena._Free.insert(arena._Free.end(), free.begin(), free.end());
+            }
+        };
+        if (gone)
+            return nullptr;
+        static thread_local cache result;
+        return &result.free;
+    }
+
+    node_arena() : _Next(1), _Blocks(1 << (32 - block_bits), nullptr) { }
+
+    // moves up to count free indices into cache, reused ones first; under _Mutex
+    void refill(vector<uint32_t>& cache, size_t count) {
+        size_t reused = min(count, _Free.size());
+        cache.insert(cache.end(), _Free.end() - reused, _Free.end());
+        _Free.resize(_Free.size() - reused);
+        for (; reused < count && _Next != numeric_limits<uint32_t>::max(); reused++) {
+            if (!_Blocks[_Next >> block_bits])
+                _Blocks[_Next >> block_bits] = new block;
+            cache.push_back(_Next++);
+        }
+        // running past the last index would hand out the null handle and live slots again
+        if (cache.empty())
+            throw bad_alloc();
+    }
+
+    void give_back(uint32_t index) {
+        auto cache = local_cache();
+        if (!cache) {
+            lock_guard<mutex> lock(_Mutex);
+            _Free.push_back(index);
+            return;
+        }
+        cache->push_back(index);
+        if (cache->size() >= 2 * cache_batch) {
+            lock_guard<mutex> lock(_Mutex);
+            _Free.insert(_Free.end(), cache->end() - cache_batch, cache->end());
+            cache->resize(cache->size() - cache_batch);
+        }
+    }
+
+    // counts a node into its block, waiting out a trim of the block
+    void enter(uint32_t index) {
+        auto& live = _Blocks[index >> block_bits]->live;
+        while (live.fetch_add(1, memory_order_acquire) & trimming) {
+            live.fetch_sub(1, memory_order_relaxed);
+            this_thread::yield();
+        }
+    }
+
+    void leave(uint32_t index) {
+        _Blocks[index >> block_bits]->live.fetch_sub(1, memory_order_release);
+    }
+
+    storage& slot(uint32_t index) const {
+        return _Blocks[index >> block_bits]->nodes[index & ((1 << block_bits) - 1)];
+    }
+
+    atomic<uint32_t>& refcount(uint32_t index) const {
+        return _Blocks[index >> block_bits]->refcounts[index & ((1 << block_bits) - 1)];
+    }
+
+    mutable mutex _Mutex;
+    uint32_t _Next;
+    vector<uint32_t> _Free;
+    // sized once up front, so readers never race with a reallocation
+    vector<block*> _Blocks;
+};
+
+// shared_ptr-like handle to a node in the arena
+template <class T>
+class arena_ptr {
+public:
+    arena_ptr(nullptr_t = nullptr) : _Index(0) { }
+
+    arena_ptr(const arena_ptr& rhs) : _Index(rhs._Index) {
+        node_arena<T>::instance().retain(_Index);
+    }
+
+    arena_ptr(arena_ptr&& rhs) : _Index(rhs._Index) {
+        rhs._Index = 0;
+    }
+
+    arena_ptr& operator=(arena_ptr rhs) {
+        swap(_Index, rhs._Index);
+        return *this;
+    }
+
+    template <class... Args>
+    static arena_ptr make(Args&&... args) {
+        arena_ptr result;
+        result._Index = node_arena<T>::instance().allocate(std::forward<Args>(args)...);
+        return result;
+    }
+
+    // constructs a node in a slot obtained from node_arena::reserve
+    template <class... Args>
+    static arena_ptr make_at(uint32_t index, Args&&... args) {
+        arena_ptr result;
+        node_arena<T>::instance().construct(index, std::forward<Args>(args)...);
+        result._Index = index;
+        return result;
+    }
+
+    const node<T>* get() const { return node_arena<T>::instance().at(_Index); }
+    const node<T>* operator->() const { return get(); }
+    const node<T>& operator*() const { return *get(); }
+    explicit operator bool() const { return _Index != 0; }
+    const long use_count() const { return node_arena<T>::instance().use_count(_Index); }
+
+    const bool operator==(const arena_ptr& rhs) const { return _Index == rhs._Index; }
+    const bool operator!=(const arena_ptr& rhs) const { return _Index != rhs._Index; }
+    const bool operator==(nullptr_t) const { return _Index == 0; }
+    const bool operator!=(nullptr_t) const { return _Index != 0; }
+
+    ~arena_ptr() {
+        node_arena<T>::instance().release(_Index);
+    }
+private:
+    uint32_t _Index;
+};
+
+} // namespace impl
+
+#endif
@@ -0,0 +1,255 @@
+#ifndef _ORDERED_TREAP_H_
+#define _ORDERED_TREAP_H_
+
+#include <functional>
+#include <tuple>
+#include "implicit_treap.h"
+
+namespace impl {
+
+// splits tree into keys less than key, the node with equal key (if any) and keys greater than key
+template <class K, class V, class Compare>
+const tuple<node_ptr<pair<K, V>>, node_ptr<pair<K, V>>, node_ptr<pair<K, V>>> split_by_key(
+    node_ptr<pair<K, V>> tree,
+    const K& key,
+    const Compare& comp) {
+
+    if (!tree)
+        return make_tuple(nullptr, nullptr, nullptr);
+    if (comp(key, tree->val().first)) {
+        auto splitted = split_by_key(tree->left(), key, comp);
+        return make_tuple(get<0>(splitted), get<1>(splitted), make_node<pair<K, V>>(tree->cell(), get<2>(splitted), tree->right()));
+    }
+    else if (comp(tree->val().first, key)) {
+        auto splitted = split_by_key(tree->right(), key, comp);
+        return make_tuple(make_node<pair<K, V>>(tree->cell(), tree->left(), get<0>(splitted)), get<1>(splitted), get<2>(splitted));
+    }
+    else {
+        return make_tuple(tree->left(), tree, tree->right());
+    }
+}
+
+template <class K, class V, class Compare>
+const treap_size_t key_rank(node_ptr<pair<K, V>> tree, const K& key, const Compare& comp) {
+    treap_size_t result = 0;
+    while (tree) {
+        if (comp(tree->val().first, key)) {
+            result += tree->left()->size() + 1;
+            tree = tree->right();
+        }
+        else {
+            tree = tree->left();
+        }
+    }
+    return result;
+}
+
+// on equal keys the value from lhs is kept
+template <class K, class V, class Compare>
+node_ptr<pair<K, V>> set_union(
+    node_ptr<pair<K, V>> lhs,
+    node_ptr<pair<K, V>> rhs,
+    const Compare& comp,
+    int depth = parallel_depth()) {
+
+    typedef pair<K, V> T1;
+    if (!lhs) return rhs;
+    if (!rhs) return lhs;
+    bool parallel = depth > 0 && lhs->size() + rhs->size() >= parallel_cutoff;
+    if (greater_priority(lhs, rhs)) {
+        auto splitted = split_by_key(rhs, lhs->val().first, comp);
+        auto parts = fork_join<T1>(parallel,
+            [&]() { return set_union(lhs->left(), get<0>(splitted), comp, depth - 1); },
+            [&]() { return set_union(lhs->right(), get<2>(splitted), comp, depth - 1); });
+        return join(parts.first, lhs->cell(), parts.second);
+    }
+    else {
+        auto splitted = split_by_key(lhs, rhs->val().first, comp);
+        auto parts = fork_join<T1>(parallel,
+            [&]() { return set_union(get<0>(splitted), rhs->left(), comp, depth - 1); },
+            [&]() { return set_union(get<2>(splitted), rhs->right(), comp, depth - 1); });
+        return join(parts.first, get<1>(splitted) ? get<1>(splitted)->cell() : rhs->cell(), parts.second);
+    }
+}
+
+template <class K, class V, class Compare>
+node_ptr<pair<K, V>> set_intersection(
+    node_ptr<pair<K, V>> lhs,
+    node_ptr<pair<K, V>> rhs,
+    const Compare& comp,
+    int depth = parallel_depth()) {
+
+    typedef pair<K, V> T1;
+    if (!lhs || !rhs)
+        return nullptr;
+    bool parallel = depth > 0 && lhs->size() + rhs->size() >= parallel_cutoff;
+    auto splitted = split_by_key(rhs, lhs->val().first, comp);
+    auto parts = fork_join<T1>(parallel,
+        [&]() { return set_intersection(lhs->left(), get<0>(splitted), comp, depth - 1); },
+        [&]() { return set_intersection(lhs->right(), get<2>(splitted), comp, depth - 1); });
+    if (get<1>(splitted))
+        return join(parts.first, lhs->cell(), parts.second);
+    return merge(parts.first, parts.second);
+}
+
+template <class K, class V, class Compare>
+node_ptr<pair<K, V>> set_difference(
+    node_ptr<pair<K, V>> lhs,
+    node_ptr<pair<K, V>> rhs,
+    const Compare& comp,
+    int depth = parallel_depth()) {
+
+    typedef pair<K, V> T1;
+    if (!lhs || !rhs)
+        return lhs;
+    bool parallel = depth > 0 && lhs->size() + rhs->size() >= parallel_cutoff;
+    auto splitted = split_by_key(rhs, lhs->val().first, comp);
+    auto parts = fork_join<T1>(parallel,
+        [&]() { return set_difference(lhs->left(), get<0>(splitted), comp, depth - 1); },
+        [&]() { return set_difference(lhs->right(), get<2>(splitted), comp, depth - 1); });
+    if (get<1>(splitted))
+        return merge(parts.first, parts.second);
+    return join(parts.first, lhs->cell(), parts.second);
+}
+
+} // namespace impl
+
+template <class K, class V, class Compare = less<K>>
+class persistent_ordered_treap {
+public:
+    typedef pair<K, V> value_type;
+    typedef node_iterator<value_type> const_iterator;
+
+    persistent_ordered_treap(node_ptr<value_type> root = nullptr, const Compare& comp = Compare()) : _Root(root), _Comp(comp) { }
+
+    // elements with duplicate keys keep the first occurrence
+    template <class TIter>
+    persistent_ordered_treap(TIter begin, TIter end, const Compare& comp = Compare());
+
+    const treap_size_t size() const { return _Root->size(); }
+    const treap_size_t height() const { return _Root->height(); }
+    const bool empty() const { return _Root == nullptr; }
+
+    persistent_ordered_treap insert(const K& key, const V& val) const;
+    persistent_ordered_treap erase(const K& key) const;
+
+    const_iterator find(const K& key) const;
+    const_iterator lower_bound(const K& key) const;
+    const_iterator upper_bound(const K& key) const;
+    const bool contains(const K& key) const { return find(key) != cend(); }
+
+    // number of keys less than key
+    const treap_size_t rank(const K& key) const { return key_rank(_Root, key, _Comp); }
+    const value_type& select(treap_size_t index) const;
+
+    const bool is(const persistent_ordered_treap& rhs) const {
+        return _Root == rhs._Root;
+    }
+
+    // on equal keys the values of lhs are kept
+    template <class K1, class V1, class C1>
+    friend persistent_ordered_treap<K1, V1, C1> set_union(const persistent_ordered_treap<K1, V1, C1>& lhs, const persistent_ordered_treap<K1, V1, C1>& rhs);
+
+    template <class K1, class V1, class C1>
+    friend persistent_ordered_treap<K1, V1, C1> set_intersection(const persistent_ordered_treap<K1, V1, C1>& lhs, const persistent_ordered_treap<K1, V1, C1>& rhs);
+
+    template <class K1, class V1, class C1>
+    friend persistent_ordered_treap<K1, V1, C1> set_difference(const persistent_ordered_treap<K1, V1, C1>& lhs, const persistent_ordered_treap<K1, V1, C1>& rhs);
+
+    const_iterator cbegin() const { return const_iterator(_Root); }
+    const_iterator cend() const { return const_iterator(nullptr); }
+
+    persistent_treap<value_type> freeze_sequence() const {
+        return persistent_treap<value_type>(_Root);
+    }
+private:
+    node_ptr<value_type> _Root;
+    Compare _Comp;
+};
+
+template <class K, class V, class Compare>
+template <class TIter>
+persistent_ordered_treap<K, V, Compare>::persistent_ordered_treap(TIter begin, TIter end, const Compare& comp) : _Comp(comp) {
+    auto elements = vector<value_type>(begin, end);
+    stable_sort(elements.begin(), elements.end(), [&](const value_type& lhs, const value_type& rhs) { return _Comp(lhs.first, rhs.first); });
+    elements.erase(unique(elements.begin(), elements.end(), [&](const value_type& lhs, const value_type& rhs) { return !_Comp(lhs.first, rhs.first); }), elements.end());
+    _Root = build<value_type>(elements.begin(), elements.end());
+}
+
+template <class K, class V, class Compare>
+persistent_ordered_treap<K, V, Compare> persistent_ordered_treap<K, V, Compare>::insert(const K& key, const V& val) const {
+    auto splitted = split_by_key(_Root, key, _Comp);
+    return persistent_ordered_treap(join(get<0>(splitted), value_cell<value_type>(make_pair(key, val)), get<2>(splitted)), _Comp);
+}
+
+template <class K, class V, class Compare>
+persistent_ordered_treap<K, V, Compare> persistent_ordered_treap<K, V, Compare>::erase(const K& key) const {
+    auto splitted = split_by_key(_Root, key, _Comp);
+    if (!get<1>(splitted))
+        return *this;
+    return persistent_ordered_treap(merge(get<0>(splitted), get<2>(splitted)), _Comp);
+}
+
+template <class K, class V, class Compare>
+typename persistent_ordered_treap<K, V, Compare>::const_iterator persistent_ordered_treap<K, V, Compare>::find(const K& key) const {
+    auto current = _Root;
+    while (current) {
+        if (_Comp(key, current->val().first))
+            current = current->left();
+        else if (_Comp(current->val().first, key))
+            current = current->right();
+        else
+            return const_iterator(_Root, rank(key));
+    }
+    return cend();
+}
+
+template <class K, class V, class Compare>
+typename persistent_ordered_treap<K, V, Compare>::const_iterator persistent_ordered_treap<K, V, Compare>::lower_bound(const K& key) const {
+    return const_iterator(_Root, rank(key));
+}
+
+template <class K, class V, class Compare>
+typename persistent_ordered_treap<K, V, Compare>::const_iterator persistent_ordered_treap<K, V, Compare>::upper_bound(const K& key) const {
+    auto it = lower_bound(key);
+    if (!it.is_end() && !_Comp(key, (*it).first))
+        ++it;
+    return it;
+}
+
+template <class K, class V, class Compare>
+const typename persistent_ordered_treap<K, V, Compare>::value_type& persistent_ordered_treap<K, V, Compare>::select(treap_size_t index) const {
+    return value_at(_Root, index);
+}
+
+template <class K1, class V1, class C1>
+persistent_ordered_treap<K1, V1, C1> set_union(const persistent_ordered_treap<K1, V1, C1>& lhs, const persistent_ordered_treap<K1, V1, C1>& rhs) {
+    return persistent_ordered_treap<K1, V1, C1>(impl::set_union(lhs._Root, rhs._Root, lhs._Comp), lhs._Comp);
+}
+
+template <class K1, class V1, class C1>
+persistent_ordered_treap<K1, V1, C1> set_intersection(const persistent_ordered_treap<K1, V1, C1>& lhs, const persistent_ordered_treap<K1, V1, C1>& rhs) {
+    return persistent_ordered_treap<K1, V1, C1>(impl::set_intersection(lhs._Root, rhs._Root, lhs._Comp), lhs._Comp);
+}
+
+template <class K1, class V1, class C1>
+persistent_ordered_treap<K1, V1, C1> set_difference(const persistent_ordered_treap<K1, V1, C1>& lhs, const persistent_ordered_treap<K1, V1, C1>& rhs) {
+    return persistent_ordered_treap<K1, V1, C1>(impl::set_difference(lhs._Root, rhs._Root, lhs._Comp), lhs._Comp);
+}
+
+template <class K1, class V1, class C1>
+persistent_ordered_treap<K1, V1, C1> operator|(const persistent_ordered_treap<K1, V1, C1>& lhs, const persistent_ordered_treap<K1, V1, C1>& rhs) {
+    return set_union(lhs, rhs);
+}
+
+template <class K1, class V1, class C1>
+persistent_ordered_treap<K1, V1, C1> operator&(const persistent_ordered_treap<K1, V1, C1>& lhs, const persistent_ordered_treap<K1, V1, C1>& rhs) {
+    return set_intersection(lhs, rhs);
+}
+
+template <class K1, class V1, class C1>
+persistent_ordered_treap<K1, V1, C1> operator-(const persistent_ordered_treap<K1, V1, C1>& lhs, const persistent_ordered_treap<K1, V1, C1>& rhs) {
+    return set_difference(lhs, rhs);
+}
+
+#endif
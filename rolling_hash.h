@@ -0,0 +1,125 @@
+#ifndef _ROLLING_HASH_H_
+#define _ROLLING_HASH_H_
+
+#include <cstdint>
+#include <functional>
+#include "implicit_treap.h"
+
+namespace impl {
+
+// polynomial hash of a sequence modulo the Mersenne prime 2^61 - 1,
+// together with base^length so that two hashes can be concatenated
+struct poly_hash_value {
+    uint64_t hash;
+    uint64_t power;
+
+    const bool operator==(const poly_hash_value& rhs) const {
+        return hash == rhs.hash && power == rhs.power;
+    }
+    const bool operator!=(const poly_hash_value& rhs) const {
+        return !operator==(rhs);
+    }
+};
+
+const uint64_t poly_hash_modulus = (uint64_t(1) << 61) - 1;
+const uint64_t poly_hash_base = 0x1fbd5b4b0dc3a1e5ULL % poly_hash_modulus;
+
+inline uint64_t poly_hash_mul(uint64_t lhs, uint64_t rhs) {
+    unsigned __int128 product = (unsigned __int128)lhs * rhs;
+    uint64_t result = (uint64_t)(product & poly_hash_modulus) + (uint64_t)(product >> 61);
+    return result >= poly_hash_modulus ? result - poly_hash_modulus : result;
+}
+
+inline uint64_t poly_hash_add(uint64_t lhs, uint64_t rhs) {
+    uint64_t result = lhs + rhs;
+    return result >= poly_hash_modulus ? result - poly_hash_modulus : result;
+}
+
+// Derive summary_traits<T> from this to keep a rolling hash in every node:
+//     template <> struct impl::summary_traits<int> : poly_hash_summary<int> { };
+template <class T, class Hash = std::hash<T>>
+struct poly_hash_summary {
+    static const bool enabled = true;
+    typedef poly_hash_value type;
+    static poly_hash_value identity() { return poly_hash_value{ 0, 1 }; }
+    static poly_hash_value of(const T& val) {
+        return poly_hash_value{ mix_hash(Hash()(val)) % poly_hash_modulus, poly_hash_base };
+    }
+    static poly_hash_value combine(const poly_hash_value& lhs, const poly_hash_value& rhs) {
+        return poly_hash_value{
+            poly_hash_add(poly_hash_mul(lhs.hash, rhs.power), rhs.hash),
+            poly_hash_mul(lhs.power, rhs.power)
+        };
+    }
+};
+
+// keeps two summaries side by side, e.g. a weight and a rolling hash
+template <class S1, class S2>
+struct summary_pair {
+    static const bool enabled = true;
+    typedef pair<typename S1::type, typename S2::type> type;
+    template <class T>
+    static type of(const T& val) { return type(S1::of(val), S2::of(val)); }
+    static type identity() { return type(S1::identity(), S2::identity()); }
+    static type combine(const type& lhs, const type& rhs) {
+        return type(S1::combine(lhs.first, rhs.first), S2::combine(lhs.second, rhs.second));
+    }
+};
+
+inline const poly_hash_value& hash_part(const poly_hash_value& summary) {
+    return summary;
+}
+
+template <class S>
+const poly_hash_value& hash_part(const pair<poly_hash_value, S>& summary) {
+    return summary.first;
+}
+
+template <class S>
+const poly_hash_value& hash_part(const pair<S, poly_hash_value>& summary) {
+    return summary.second;
+}
+
+} // namespace impl
+
+// The functions below need summary_traits<T> to contain a poly_hash_summary,
+// directly or as a part of a summary_pair.
+
+template <class T>
+uint64_t range_hash(const persistent_treap<T>& t, treap_size_t begin, treap_size_t end) {
+    return hash_part(t.summary(begin, end)).hash;
+}
+
+template <class T>
+const bool range_equal(
+    const persistent_treap<T>& lhs, treap_size_t lhs_begin, treap_size_t lhs_end,
+    const persistent_treap<T>& rhs, treap_size_t rhs_begin, treap_size_t rhs_end) {
+
+    if (lhs_end - lhs_begin != rhs_end - rhs_begin)
+        return false;
+    return hash_part(lhs.summary(lhs_begin, lhs_end)) == hash_part(rhs.summary(rhs_begin, rhs_end));
+}
+
+// length of the longest common prefix of two ranges, by binary search on range hashes
+template <class T>
+treap_size_t common_prefix(
+    const persistent_treap<T>& lhs, treap_size_t lhs_begin, treap_size_t lhs_end,
+    const persistent_treap<T>& rhs, treap_size_t rhs_begin, treap_size_t rhs_end) {
+
+    treap_size_t low = 0, high = min(lhs_end - lhs_begin, rhs_end - rhs_begin);
+    while (low < high) {
+        treap_size_t mid = low + (high - low + 1) / 2;
+        if (range_equal(lhs, lhs_begin, lhs_begin + mid, rhs, rhs_begin, rhs_begin + mid))
+            low = mid;
+        else
+            high = mid - 1;
+    }
+    return low;
+}
+
+template <class T>
+treap_size_t common_prefix(const persistent_treap<T>& lhs, const persistent_treap<T>& rhs) {
+    return common_prefix(lhs, 0, lhs.size(), rhs, 0, rhs.size());
+}
+
+#endif
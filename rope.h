@@ -0,0 +1,294 @@
+#ifndef _ROPE_H_
+#define _ROPE_H_
+
+#include <string>
+#include <istream>
+#include <ostream>
+#include "implicit_treap.h"
+
+namespace impl {
+
+inline const bool is_utf8_continuation(char c) {
+    return (static_cast<unsigned char>(c) & 0xC0) == 0x80;
+}
+
+// length of the longest prefix of s not ending in an incomplete UTF-8 sequence
+inline size_t utf8_complete_prefix(const string& s) {
+    size_t lead = s.size();
+    while (lead > 0 && s.size() - lead < 4 && is_utf8_continuation(s[lead - 1]))
+        lead--;
+    if (lead == 0)
+        return s.size();
+    unsigned char c = s[lead - 1];
+    size_t length = c >= 0xF0 ? 4 : c >= 0xE0 ? 3 : c >= 0xC0 ? 2 : 1;
+    return lead - 1 + length > s.size() ? lead - 1 : s.size();
+}
+
+// piece of text stored in one node of a rope
+struct text_chunk {
+    string text;
+    treap_size_t newlines;
+    treap_size_t codepoints;
+
+    text_chunk(string s) : text(std::move(s)), newlines(0), codepoints(0) {
+        for (char c : text) {
+            newlines += c == '\n';
+            codepoints += !is_utf8_continuation(c);
+        }
+    }
+};
+
+struct text_summary {
+    treap_size_t bytes;
+    treap_size_t newlines;
+    treap_size_t codepoints;
+};
+
+template <>
+struct summary_traits<text_chunk> {
+    static const bool enabled = true;
+    typedef text_summary type;
+    static text_summary identity() { return text_summary{ 0, 0, 0 }; }
+    static text_summary of(const text_chunk& chunk) {
+        return text_summary{ treap_size_t(chunk.text.size()), chunk.newlines, chunk.codepoints };
+    }
+    static text_summary combine(const text_summary& lhs, const text_summary& rhs) {
+        return text_summary{ lhs.bytes + rhs.bytes, lhs.newlines + rhs.newlines, lhs.codepoints + rhs.codepoints };
+    }
+};
+
+} // namespace impl
+
+// Persistent text buffer: a treap of chunks of at most chunk_size bytes,
+// with byte, newline and codepoint counts cached in every node. Chunk
+// boundaries never fall inside a UTF-8 sequence. Lines are counted from 0.
+class rope {
+public:
+    typedef persistent_treap<text_chunk>::const_iterator chunk_iterator;
+
+    static const treap_size_t chunk_size = 1024;
+
+    rope() { }
+    rope(const string& text) : _Chunks(chunks_of(text)) { }
+
+    static rope load(istream& in);
+    void save(ostream& out) const;
+
+    const treap_size_t size() const { return _Chunks.summary().bytes; }
+    const treap_size_t codepoints() const { return _Chunks.summary().codepoints; }
+    const treap_size_t lines() const { return _Chunks.summary().newlines + 1; }
+    const bool empty() const { return _Chunks.empty(); }
+
+    const char operator[](treap_size_t offset) const;
+    string str() const { return substr(0, size()); }
+    string substr(treap_size_t begin, treap_size_t end) const;
+
+    rope insert(treap_size_t offset, const string& text) const;
+    rope erase(treap_size_t begin, treap_size_t end) const;
+    rope slice(treap_size_t begin, treap_size_t end) const;
+
+    const treap_size_t offset_of_line(treap_size_t line) const;
+    const treap_size_t line_of_offset(treap_size_t offset) const;
+    const treap_size_t offset_of_codepoint(treap_size_t index) const;
+    const treap_size_t codepoint_of_offset(treap_size_t offset) const;
+
+    // chunks are visited in place, without copying the text
+    chunk_iterator chunks_begin() const { return _Chunks.cbegin(); }
+    chunk_iterator chunks_end() const { return _Chunks.cend(); }
+
+    friend rope operator+(const rope& lhs, const rope& rhs) {
+        return rope(lhs._Chunks + rhs._Chunks);
+    }
+
+private:
+    rope(const persistent_treap<text_chunk>& chunks) : _Chunks(chunks) { }
+
+    // text cut into pieces of at most chunk_size bytes
+    static vector<string> pieces_of(const string& text);
+    static persistent_treap<text_chunk> chunks_of(const string& text);
+
+    // replaces chunks [first, last) by text, absorbing a neighbour that fits in
+    // one chunk with the piece next to it, so edits leave no runs of tiny chunks
+    rope replace_chunks(treap_size_t first, treap_size_t last, const string& text) const;
+
+    // chunk holding the byte at offset, and the offset where that chunk starts
+    pair<treap_size_t, treap_size_t> locate(treap_size_t offset) const;
+
+    persistent_treap<text_chunk> _Chunks;
+};
+
+inline vector<string> rope::pieces_of(const string& text) {
+    auto pieces = vector<string>();
+    size_t begin = 0;
+    while (begin < text.size()) {
+        size_t end = min(text.size(), begin + chunk_size);
+        while (end < text.size() && end > begin + 1 && is_utf8_continuation(text[end]))
+            end--;
+        pieces.push_back(text.substr(begin, end - begin));
+        begin = end;
+    }
+    return pieces;
+}
+
+inline persistent_treap<text_chunk> rope::chunks_of(const string& text) {
+    auto pieces = pieces_of(text);
+    auto chunks = vector<text_chunk>(pieces.begin(), pieces.end());
+    return persistent_treap<text_chunk>(chunks.begin(), chunks.end());
+}
+
+inline rope rope::replace_chunks(treap_size_t first, treap_size_t last, const string& text) const {
+    auto pieces = pieces_of(text);
+    if (first > 0 && (pieces.empty() || _Chunks[first - 1].text.size() + pieces.front().size() <= size_t(chunk_size))) {
+        if (pieces.empty())
+            pieces.push_back(string());
+        pieces.front().insert(0, _Chunks[--first].text);
+    }
+    if (last < _Chunks.size() && !pieces.empty() && pieces.back().size() + _Chunks[last].text.size() <= size_t(chunk_size))
+        pieces.back() += _Chunks[last++].text;
+    auto chunks = vector<text_chunk>(pieces.begin(), pieces.end());
+    auto edit = treap_edit<text_chunk>{ first, last, persistent_treap<text_chunk>(chunks.begin(), chunks.end()) };
+    return rope(_Chunks.apply_batch(vector<treap_edit<text_chunk>>(1, edit)));
+}
+
+inline rope rope::load(istream& in) {
+    auto result = persistent_treap<text_chunk>();
+    string pending;
+    auto buffer = vector<char>(chunk_size);
+    // the carried-over bytes count against the chunk size
+    while (in.read(buffer.data(), chunk_size - pending.size()) || in.gcount() > 0) {
+        pending.append(buffer.data(), in.gcount());
+        // an incomplete UTF-8 sequence at the end waits for the next read
+        size_t end = in ? utf8_complete_prefix(pending) : pending.size();
+        if (end == 0)
+            continue;
+        result = result.push_back(text_chunk(pending.substr(0, end)));
+        pending.erase(0, end);
+    }
+    if (!pending.empty())
+        result = result.push_back(text_chunk(pending));
+    return rope(result);
+}
+
+inline void rope::save(ostream& out) const {
+    for (auto current = chunks_begin(); current != chunks_end(); ++current)
+        out.write((*current).text.data(), (*current).text.size());
+}
+
+inline pair<treap_size_t, treap_size_t> rope::locate(treap_size_t offset) const {
+    treap_size_t index = _Chunks.find_by_prefix([offset](const text_summary& s) { return s.bytes > offset; });
+    return make_pair(index, _Chunks.summary(0, index).bytes);
+}
+
+inline const char rope::operator[](treap_size_t offset) const {
+    auto location = locate(offset);
+    return _Chunks[location.first].text[offset - location.second];
+}
+
+inline string rope::substr(treap_size_t begin, treap_size_t end) const {
+    string result;
+    if (begin >= end)
+        return result;
+    auto location = locate(begin);
+    treap_size_t start = location.second;
+    for (auto current = _Chunks.view(location.first, _Chunks.size()).cbegin(); !current.is_end() && start < end; ++current) {
+        const string& text = (*current).text;
+        treap_size_t from = max(begin - start, treap_size_t(0)), to = min(end - start, treap_size_t(text.size()));
+        result.append(text, from, to - from);
+        start += text.size();
+    }
+    return result;
+}
+
+inline rope rope::insert(treap_size_t offset, const string& text) const {
+    if (text.empty())
+        return *this;
+    auto location = locate(offset);
+    if (location.first == _Chunks.size())
+        return replace_chunks(location.first, location.first, text);
+    string merged = _Chunks[location.first].text;
+    merged.insert(offset - location.second, text);
+    return replace_chunks(location.first, location.first + 1, merged);
+}
+
+inline rope rope::erase(treap_size_t begin, treap_size_t end) const {
+    begin = max(begin, treap_size_t(0));
+    end = min(end, size());
+    if (begin >= end)
+        return *this;
+    auto first = locate(begin), last = locate(end - 1);
+    string kept = _Chunks[first.first].text.substr(0, begin - first.second);
+    const string& last_text = _Chunks[last.first].text;
+    kept += last_text.substr(end - last.second);
+    return replace_chunks(first.first, last.first + 1, kept);
+}
+
+inline rope rope::slice(treap_size_t begin, treap_size_t end) const {
+    begin = max(begin, treap_size_t(0));
+    end = min(end, size());
+    if (begin >= end)
+        return rope();
+    auto first = locate(begin), last = locate(end - 1);
+    if (first.first == last.first)
+        return rope(_Chunks[first.first].text.substr(begin - first.second, end - begin));
+    string head = _Chunks[first.first].text.substr(begin - first.second);
+    string tail = _Chunks[last.first].text.substr(0, end - last.second);
+    if (first.first + 1 == last.first)
+        return rope(head + tail);
+    // the chunks in between are shared; the cut ends go through replace_chunks,
+    // so a short end is absorbed by its neighbour like after an edit
+    auto middle = rope(_Chunks.slice(first.first, last.first + 1));
+    middle = middle.replace_chunks(middle._Chunks.size() - 1, middle._Chunks.size(), tail);
+    return middle.replace_chunks(0, 1, head);
+}
+
+inline const treap_size_t rope::offset_of_line(treap_size_t line) const {
+    if (line <= 0)
+        return 0;
+    treap_size_t index = _Chunks.find_by_prefix([line](const text_summary& s) { return s.newlines >= line; });
+    if (index == _Chunks.size())
+        return size();
+    auto before = _Chunks.summary(0, index);
+    const string& text = _Chunks[index].text;
+    treap_size_t pos = 0;
+    for (treap_size_t seen = before.newlines; ; pos++) {
+        if (text[pos] == '\n' && ++seen == line)
+            break;
+    }
+    return before.bytes + pos + 1;
+}
+
+inline const treap_size_t rope::line_of_offset(treap_size_t offset) const {
+    auto location = locate(offset);
+    treap_size_t result = _Chunks.summary(0, location.first).newlines;
+    if (location.first < _Chunks.size()) {
+        const string& text = _Chunks[location.first].text;
+        result += count(text.begin(), text.begin() + (offset - location.second), '\n');
+    }
+    return result;
+}
+
+inline const treap_size_t rope::offset_of_codepoint(treap_size_t index) const {
+    treap_size_t chunk = _Chunks.find_by_prefix([index](const text_summary& s) { return s.codepoints > index; });
+    if (chunk == _Chunks.size())
+        return size();
+    auto before = _Chunks.summary(0, chunk);
+    const string& text = _Chunks[chunk].text;
+    treap_size_t pos = 0;
+    for (treap_size_t seen = before.codepoints - 1; ; pos++) {
+        if (!is_utf8_continuation(text[pos]) && ++seen == index)
+            break;
+    }
+    return before.bytes + pos;
+}
+
+inline const treap_size_t rope::codepoint_of_offset(treap_size_t offset) const {
+    auto location = locate(offset);
+    treap_size_t result = _Chunks.summary(0, location.first).codepoints;
+    if (location.first < _Chunks.size()) {
+        const string& text = _Chunks[location.first].text;
+        result += count_if(text.begin(), text.begin() + (offset - location.second), [](char c) { return !is_utf8_continuation(c); });
+    }
+    return result;
+}
+
+#endif
@@ -0,0 +1,1243 @@
+// Checks each feature against a plain std::vector or std::set model.
+// Built without optimization like the rest of the tree: make test
+#include <algorithm>
+#include <cstdlib>
+#include <ctime>
+#include <deque>
+#include <iostream>
+#include <iterator>
+#include <limits>
+#include <sstream>
+#include <set>
+#include <string>
+#include <vector>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include "implicit_treap.h"
+#include "ordered_treap.h"
+#include "rolling_hash.h"
+#include "rope.h"
+#include "treap_builder.h"
+#include "treap_log.h"
+#include "treap_shm.h"
+
+using namespace std;
+
+// element with a summed weight; the summary counts its combine calls
+struct weight {
+    long long w;
+};
+
+static long long combines = 0;
+
+namespace impl {
+
+template <>
+struct summary_traits<weight> {
+    static const bool enabled = true;
+    typedef long long type;
+    static long long identity() { return 0; }
+    static long long of(const weight& val) { return val.w; }
+    static long long combine(long long lhs, long long rhs) {
+        combines++;
+        return lhs + rhs;
+    }
+};
+
+// characters keep a rolling hash
+template <>
+struct summary_traits<char> : poly_hash_summary<char> { };
+
+} // namespace impl
+
+static int failures = 0;
+
+#define CHECK(cond) do { \
+    if (!(cond)) { \
+        cerr << __FILE__ << ":" << __LINE__ << ": check failed: " #cond << endl; \
+        failures++; \
+    } \
+} while (0)
+
+template <class T>
+vector<T> to_vector(const persistent_treap<T>& t) {
+    auto result = vector<T>();
+    for (auto it = t.cbegin(); !it.is_end(); ++it)
+        result.push_back(*it);
+    return result;
+}
+
+// a generous bound on the height of a treap of size elements with random priorities
+treap_size_t log_height_bound(treap_size_t size) {
+    treap_size_t bits = 1;
+    while ((treap_size_t(1) << bits) <= size)
+        bits++;
+    return 4 * bits;
+}
+
+vector<int> random_values(int n, int range) {
+    auto result = vector<int>();
+    for (int i = 0; i < n; i++)
+        result.push_back(rand() % range);
+    return result;
+}
+
+typedef persistent_ordered_treap<int, int> ordered;
+
+vector<int> keys_of(const ordered& t) {
+    auto result = vector<int>();
+    for (auto it = t.cbegin(); !it.is_end(); ++it)
+        result.push_back((*it).first);
+    return result;
+}
+
+node_ptr<pair<int, int>> ordered_tree(const set<int>& keys) {
+    auto elements = vector<pair<int, int>>();
+    for (int key : keys)
+        elements.push_back(make_pair(key, key));
+    return build<pair<int, int>>(elements.begin(), elements.end());
+}
+
+void test_ordered_set_operations() {
+    for (int round = 0; round < 50; round++) {
+        auto a = random_values(rand() % 200, 300), b = random_values(rand() % 200, 300);
+        auto sa = set<int>(a.begin(), a.end()), sb = set<int>(b.begin(), b.end());
+        auto pairs_a = vector<pair<int, int>>(), pairs_b = vector<pair<int, int>>();
+        for (int x : a)
+            pairs_a.push_back(make_pair(x, 1));
+        for (int x : b)
+            pairs_b.push_back(make_pair(x, 2));
+        auto ta = ordered(pairs_a.begin(), pairs_a.end()), tb = ordered(pairs_b.begin(), pairs_b.end());
+
+        auto expected = vector<int>();
+        set_union(sa.begin(), sa.end(), sb.begin(), sb.end(), back_inserter(expected));
+        auto united = ta | tb;
+        CHECK(keys_of(united) == expected);
+        for (auto it = united.cbegin(); !it.is_end(); ++it)
+            CHECK((*it).second == (sa.count((*it).first) ? 1 : 2));
+
+        expected.clear();
+        set_intersection(sa.begin(), sa.end(), sb.begin(), sb.end(), back_inserter(expected));
+        CHECK(keys_of(ta & tb) == expected);
+
+        expected.clear();
+        set_difference(sa.begin(), sa.end(), sb.begin(), sb.end(), back_inserter(expected));
+        CHECK(keys_of(ta - tb) == expected);
+
+        CHECK(ta.size() == treap_size_t(sa.size()));
+        for (int key = 0; key < 300; key += 7) {
+            CHECK(ta.contains(key) == (sa.count(key) > 0));
+            CHECK(ta.rank(key) == treap_size_t(distance(sa.begin(), sa.lower_bound(key))));
+        }
+    }
+
+    // large enough to fork, with a fixed depth so that threads run on any machine
+    auto sa = set<int>(), sb = set<int>();
+    for (int i = 0; i < 40000; i++) {
+        sa.insert(rand() % 100000);
+        sb.insert(rand() % 100000);
+    }
+    auto expected = vector<int>();
+    set_union(sa.begin(), sa.end(), sb.begin(), sb.end(), back_inserter(expected));
+    CHECK(keys_of(ordered(impl::set_union(ordered_tree(sa), ordered_tree(sb), less<int>(), 3))) == expected);
+    expected.clear();
+    set_intersection(sa.begin(), sa.end(), sb.begin(), sb.end(), back_inserter(expected));
+    CHECK(keys_of(ordered(impl::set_intersection(ordered_tree(sa), ordered_tree(sb), less<int>(), 3))) == expected);
+    expected.clear();
+    set_difference(sa.begin(), sa.end(), sb.begin(), sb.end(), back_inserter(expected));
+    CHECK(keys_of(ordered(impl::set_difference(ordered_tree(sa), ordered_tree(sb), less<int>(), 3))) == expected);
+
+    // joins keep the result as shallow as a treap with random priorities
+    auto ia = ordered(), ib = ordered();
+    for (int key : sa)
+        ia = ia.insert(key, 1);
+    for (int key : sb)
+        ib = ib.insert(key, 2);
+    CHECK(ia.height() <= log_height_bound(ia.size()));
+    auto united = ia | ib, common = ia & ib, only = ia - ib;
+    CHECK(united.height() <= log_height_bound(united.size()));
+    CHECK(common.height() <= log_height_bound(common.size()));
+    CHECK(only.height() <= log_height_bound(only.size()));
+}
+
+void test_end_operations() {
+    typedef persistent_treap<int> seq;
+    auto t = seq();
+    auto model = deque<int>();
+    for (int step = 0; step < 20000; step++) {
+        int op = rand() % 4;
+        // drifts up, so that the tree is used as well as the buffers
+        if (op == 0 || (op == 2 && model.empty()) || step % 3 == 0) {
+            t = t.push_back(step);
+            model.push_back(step);
+        }
+        else if (op == 1 || (op == 3 && model.empty())) {
+            t = t.push_front(step);
+            model.push_front(step);
+        }
+        else if (op == 2) {
+            t = t.pop_back();
+            model.pop_back();
+        }
+        else {
+            t = t.pop_front();
+            model.pop_front();
+        }
+        if (step % 1000 == 0)
+            CHECK(to_vector(t) == vector<int>(model.begin(), model.end()));
+    }
+    CHECK(to_vector(t) == vector<int>(model.begin(), model.end()));
+
+    // pushing and popping across a full buffer leaves the tree alone
+    auto full = seq();
+    for (int i = 0; i < 1000 + seq::buffer_capacity; i++)
+        full = full.push_back(i);
+    auto overflowed_back = full.push_back(-1), back = overflowed_back;
+    for (int i = 0; i < 10; i++)
+        back = back.pop_back().pop_back().push_back(i).push_back(i);
+    auto overflowed_front = full.push_front(-1), front = overflowed_front;
+    for (int i = 0; i < 10; i++)
+        front = front.pop_front().pop_front().push_front(i).push_front(i);
+    auto usage = measure_memory(vector<seq>{ overflowed_back, back, overflowed_front, front });
+    CHECK(usage.exclusive_bytes[1] <= 2 * memory_walk<int>::block_bytes(seq::buffer_capacity));
+    CHECK(usage.exclusive_bytes[3] <= 2 * memory_walk<int>::block_bytes(seq::buffer_capacity));
+
+    // versions pushed from the same version all see their own cell, though
+    // only the first grows the shared storage in place
+    auto branched = full.push_back(-1).push_front(-1);
+    auto branches = vector<seq>();
+    for (int i = 0; i < 4; i++)
+        branches.push_back(branched.push_back(i).push_front(i));
+    for (int i = 0; i < 4; i++) {
+        auto expected = to_vector(branched);
+        expected.insert(expected.begin(), i);
+        expected.push_back(i);
+        CHECK(to_vector(branches[i]) == expected);
+    }
+    CHECK(branched.front() == -1 && branched.back() == -1);
+
+    // a positional edit copies one buffer or one path, never the buffers into the tree
+    auto buffered = full.push_front(-1).push_front(-2);
+    auto model_full = to_vector(buffered);
+    treap_size_t last = buffered.size() - 1;
+    for (treap_size_t pos : { treap_size_t(0), treap_size_t(1), treap_size_t(500), last - 1, last }) {
+        auto edited = vector<seq>{ buffered, buffered.set(pos, 7), buffered.insert(pos, 7), buffered.erase(pos) };
+        auto expected = model_full;
+        expected[pos] = 7;
+        CHECK(to_vector(edited[1]) == expected);
+        expected = model_full;
+        expected.insert(expected.begin() + pos, 7);
+        CHECK(to_vector(edited[2]) == expected);
+        expected = model_full;
+        expected.erase(expected.begin() + pos);
+        CHECK(to_vector(edited[3]) == expected);
+        usage = measure_memory(edited);
+        for (int i = 1; i < 4; i++)
+            CHECK(usage.exclusive_bytes[i] <= size_t(buffered.height()) * memory_walk<int>::node_bytes() + memory_walk<int>::block_bytes(seq::buffer_capacity));
+    }
+}
+
+template <class V>
+vector<int> view_values(const V& view) {
+    auto result = vector<int>();
+    for (auto it = view.cbegin(); it != view.cend(); ++it)
+        result.push_back(*it);
+    for (treap_size_t i = 0; i < view.size(); i++)
+        CHECK(view[i] == result[i]);
+    return result;
+}
+
+void test_views() {
+    for (int round = 0; round < 200; round++) {
+        auto values = random_values(rand() % 200, 1000);
+        auto t = persistent_treap<int>(values.begin(), values.end());
+        int n = values.size();
+        CHECK(view_values(t.view()) == values);
+
+        int begin = rand() % (n + 1), end = rand() % (n + 1);
+        if (begin > end)
+            swap(begin, end);
+        auto part = vector<int>(values.begin() + begin, values.begin() + end);
+        auto sliced = t.view(begin, end);
+        CHECK(view_values(sliced) == part);
+
+        auto joined = sliced + t.view() + sliced;
+        auto expected = part;
+        expected.insert(expected.end(), values.begin(), values.end());
+        expected.insert(expected.end(), part.begin(), part.end());
+        CHECK(view_values(joined) == expected);
+        CHECK(to_vector(joined.materialize()) == expected);
+
+        int m = expected.size();
+        begin = rand() % (m + 1), end = rand() % (m + 1);
+        if (begin > end)
+            swap(begin, end);
+        auto expected_slice = vector<int>(expected.begin() + begin, expected.begin() + end);
+        CHECK(view_values(joined.slice(begin, end)) == expected_slice);
+        CHECK(to_vector(joined.slice(begin, end).materialize()) == expected_slice);
+    }
+}
+
+void test_cursor() {
+    auto values = random_values(1000, 1000);
+    auto t = persistent_treap<int>(values.begin(), values.end());
+    auto cursor = t.cursor(500);
+    auto model = values;
+    int pos = 500;
+    for (int step = 0; step < 20000; step++) {
+        int n = model.size(), x = rand();
+        switch (rand() % 6) {
+        case 0:
+            cursor.insert(x);
+            model.insert(model.begin() + pos++, x);
+            break;
+        case 1:
+            if (pos > 0) {
+                cursor.erase_before();
+                model.erase(model.begin() + --pos);
+            }
+            break;
+        case 2:
+            if (pos < n) {
+                cursor.erase_after();
+                model.erase(model.begin() + pos);
+            }
+            break;
+        case 3:
+            if (pos < n) {
+                cursor.set(x);
+                model[pos] = x;
+            }
+            break;
+        case 4: {
+            // mostly short steps, now and then a jump
+            int delta = rand() % 50 ? rand() % 71 - 35 : rand() % (n + 1) - pos;
+            if (pos + delta >= 0 && pos + delta <= n) {
+                cursor.move(delta);
+                pos += delta;
+            }
+            break;
+        }
+        default:
+            if (pos < n)
+                CHECK(cursor.get() == model[pos]);
+            if (pos > 0)
+                CHECK(cursor.get(-1) == model[pos - 1]);
+        }
+        CHECK(cursor.position() == pos && cursor.size() == treap_size_t(model.size()));
+    }
+    CHECK(to_vector(cursor.commit()) == model);
+    CHECK(to_vector(t) == values);
+
+    // reading or editing past either end throws instead of reading a buffer out of bounds
+    auto at = [](treap_cursor<int> c, int what) {
+        try {
+            if (what == 0)
+                c.get();
+            else if (what == 1)
+                c.get(-int(c.position()) - 1);
+            else if (what == 2)
+                c.set(0);
+            else if (what == 3)
+                c.erase_after();
+            else
+                c.erase_before();
+        }
+        catch (const out_of_range&) {
+            return true;
+        }
+        return false;
+    };
+    auto end = t.cursor(t.size()), begin = t.cursor(0);
+    CHECK(at(end, 0) && at(end, 1) && at(end, 2) && at(end, 3) && !at(end, 4));
+    CHECK(!at(begin, 0) && at(begin, 1) && !at(begin, 2) && !at(begin, 3) && at(begin, 4));
+}
+
+void test_apply_batch() {
+    for (int round = 0; round < 300; round++) {
+        auto values = random_values(rand() % 300, 1000);
+        auto t = persistent_treap<int>(values.begin(), values.end());
+        int n = values.size(), pos = 0, last_insert = -1;
+        auto edits = vector<treap_edit<int>>();
+        auto expected = vector<int>();
+        // non-overlapping edits against t, at most one insert per position
+        for (;;) {
+            int begin = pos + rand() % 20, end = begin, kind = rand() % 4, x = rand();
+            if (begin > n)
+                break;
+            expected.insert(expected.end(), values.begin() + pos, values.begin() + begin);
+            if (kind == 0 && begin != last_insert) {
+                edits.push_back(treap_edit<int>::insert(begin, x));
+                expected.push_back(x);
+                last_insert = begin;
+            }
+            else if (kind == 1 && begin < n) {
+                edits.push_back(treap_edit<int>::erase(begin));
+                end = begin + 1;
+            }
+            else if (kind == 2 && begin < n) {
+                edits.push_back(treap_edit<int>::set(begin, x));
+                expected.push_back(x);
+                end = begin + 1;
+            }
+            else if (kind == 3) {
+                end = min(n, begin + rand() % 5);
+                edits.push_back(treap_edit<int>::erase(begin, end));
+            }
+            pos = end;
+        }
+        expected.insert(expected.end(), values.begin() + pos, values.end());
+        random_shuffle(edits.begin(), edits.end());
+        CHECK(to_vector(t.apply_batch(edits)) == expected);
+        CHECK(to_vector(t) == values);
+    }
+}
+
+// large enough to be stored out of line; counts how it is constructed
+struct tracked {
+    static int copies, moves;
+    long a, b, c;
+    tracked(long a, long b, long c) : a(a), b(b), c(c) { }
+    tracked(const tracked& rhs) : a(rhs.a), b(rhs.b), c(rhs.c) { copies++; }
+    tracked(tracked&& rhs) : a(rhs.a), b(rhs.b), c(rhs.c) { moves++; }
+};
+
+int tracked::copies = 0;
+int tracked::moves = 0;
+
+// A version of at most small_threshold elements is a single flat block,
+// that is one view and its storage; a longer one has a tree or a tail.
+template <class T>
+bool is_flat_version(const persistent_treap<T>& t) {
+    auto objects = measure_memory(vector<persistent_treap<T>>{ t }).objects;
+    return t.empty() ? objects == 0 : objects == 2;
+}
+
+void test_flat_transitions() {
+    typedef persistent_treap<int> seq;
+    const int threshold = seq::small_threshold;
+    auto check = [&](const seq& t, const vector<int>& model) {
+        CHECK(to_vector(t) == model);
+        CHECK(t.size() == treap_size_t(model.size()));
+        if (!model.empty())
+            CHECK(t[model.size() / 2] == model[model.size() / 2] && t.back() == model.back());
+        CHECK(is_flat_version(t) == (int(model.size()) <= threshold));
+    };
+
+    // spilling into a tree at threshold + 1 and flattening again on the way back
+    auto t = seq();
+    auto model = vector<int>();
+    for (int i = 0; i < threshold + 1; i++) {
+        t = t.push_back(i);
+        model.push_back(i);
+        check(t, model);
+    }
+    t = t.pop_front();
+    model.erase(model.begin());
+    check(t, model);
+    t = t.insert(threshold / 2, -1);
+    model.insert(model.begin() + threshold / 2, -1);
+    check(t, model);
+    t = t.erase(0);
+    model.erase(model.begin());
+    check(t, model);
+
+    // every operation, on sizes drifting back and forth across the threshold
+    t = seq();
+    model.clear();
+    for (int step = 0; step < 6000; step++) {
+        int n = model.size(), x = rand() % 1000;
+        // grow for a while, then shrink, so that both directions are crossed often
+        bool grow = (step / 100) % 2 == 0 ? n < 3 * threshold : n < 2;
+        int pos = rand() % (n + 1), end = min(n, pos + 1 + rand() % 12);
+        auto values = random_values(1 + rand() % (rand() % 4 ? 4 : 2 * threshold), 1000);
+        auto piece = seq(values.begin(), values.end());
+        switch (rand() % 8) {
+        case 0:
+            if (grow) {
+                t = t.insert(pos, x);
+                model.insert(model.begin() + pos, x);
+            }
+            else if (pos < n) {
+                t = t.erase(pos);
+                model.erase(model.begin() + pos);
+            }
+            break;
+        case 1:
+            if (grow) {
+                t = t.insert(pos, piece);
+                model.insert(model.begin() + pos, values.begin(), values.end());
+            }
+            else {
+                t = t.erase(pos, end);
+                model.erase(model.begin() + pos, model.begin() + end);
+            }
+            break;
+        case 2:
+            if (grow && rand() % 2) {
+                t = t + piece;
+                model.insert(model.end(), values.begin(), values.end());
+            }
+            else if (grow) {
+                t = piece + t;
+                model.insert(model.begin(), values.begin(), values.end());
+            }
+            else {
+                auto halves = t.split(pos);
+                t = halves.first + halves.second.slice(end - pos, n - pos);
+                model.erase(model.begin() + pos, model.begin() + end);
+            }
+            break;
+        case 3: {
+            // an edit at pos and a set before it, in one batch
+            auto edits = vector<treap_edit<int>>();
+            if (grow) {
+                edits.push_back(treap_edit<int>::insert(pos, piece));
+                model.insert(model.begin() + pos, values.begin(), values.end());
+            }
+            else {
+                edits.push_back(treap_edit<int>::erase(pos, end));
+                model.erase(model.begin() + pos, model.begin() + end);
+            }
+            if (pos > 0) {
+                edits.push_back(treap_edit<int>::set(pos - 1, x));
+                model[pos - 1] = x;
+            }
+            t = t.apply_batch(edits);
+            break;
+        }
+        case 4:
+            if (grow) {
+                t = t.push_back(x);
+                model.push_back(x);
+            }
+            else if (n > 0) {
+                t = t.pop_back();
+                model.pop_back();
+            }
+            break;
+        case 5:
+            if (grow) {
+                t = t.push_front(x);
+                model.insert(model.begin(), x);
+            }
+            else if (n > 0) {
+                t = t.pop_front();
+                model.erase(model.begin());
+            }
+            break;
+        case 6: {
+            auto halves = t.split(pos);
+            t = halves.second + halves.first;
+            rotate(model.begin(), model.begin() + pos, model.end());
+            break;
+        }
+        default:
+            if (pos < n) {
+                t = t.set(pos, x);
+                model[pos] = x;
+            }
+            t = t.slice(0, pos) + t.slice(pos, n);
+        }
+        check(t, model);
+    }
+}
+
+// true if f throws length_error; sizes are logical, so a version near the
+// limit is cheap to build by doubling a shared one
+template <class F>
+bool too_long(F f) {
+    try {
+        f();
+    }
+    catch (const length_error&) {
+        return true;
+    }
+    return false;
+}
+
+void test_size_limits() {
+    const treap_size_t max_size = numeric_limits<treap_size_t>::max();
+    auto one = persistent_treap<int>().push_back(1), two = one.push_back(2);
+    auto half = one * (max_size / 2);
+    auto full = half + half + one;
+    CHECK(half.size() == max_size / 2 && full.size() == max_size);
+    CHECK(full[0] == 1 && full[max_size - 1] == 1);
+
+    CHECK(too_long([&]() { two * (max_size / 2 + 1); }));
+    CHECK(too_long([&]() { (max_size / 2 + 1) * two; }));
+    CHECK(!too_long([&]() { one * max_size; }));
+    CHECK(too_long([&]() { full + one; }));
+    CHECK(too_long([&]() { one + full; }));
+    CHECK(too_long([&]() { half + half + two; }));
+    CHECK(too_long([&]() { full.push_back(0); }));
+    CHECK(too_long([&]() { full.push_front(0); }));
+    CHECK(too_long([&]() { full.insert(max_size / 2, 0); }));
+    CHECK(too_long([&]() { half.insert(1, half + two); }));
+    CHECK(too_long([&]() { full.apply_batch({ treap_edit<int>::insert(0, 0) }); }));
+    CHECK(too_long([&]() { full.apply_batch({ treap_edit<int>::erase(0), treap_edit<int>::insert(1, two) }); }));
+    CHECK(too_long([&]() { merge_sorted(full, one); }));
+    CHECK(too_long([&]() { full.view() + one.view(); }));
+    CHECK(too_long([&]() { half.view() + two.view() + half.view(); }));
+
+    // edits that keep the size within the limit still go through
+    CHECK(full.pop_back().push_front(0).size() == max_size);
+    CHECK(full.apply_batch({ treap_edit<int>::erase(0), treap_edit<int>::insert(1, 5) })[0] == 5);
+    CHECK((full.erase(0).view() + one.view()).size() == max_size);
+    CHECK(full.size() == max_size && full[0] == 1);
+}
+
+void test_value_cells() {
+    auto t = persistent_treap<tracked>();
+    for (long i = 0; i < 100; i++)
+        t = t.emplace_back(i, i, i).emplace_front(-i, i, i);
+    t = t.emplace(100, 7, 8, 9);
+    CHECK(tracked::copies == 0 && tracked::moves == 0);
+    // edits around the values share them instead of copying
+    t = t.erase(3).insert(50, t).push_back(t[0]);
+    CHECK(tracked::copies == 1 && tracked::moves == 0);
+    CHECK(t.size() == 402 && t[0].a == -99 && t[t.size() - 1].a == -99);
+
+    auto strings = treap<string>();
+    for (int i = 0; i < 50; i++)
+        strings.push_back(to_string(i));
+    string moved = "moved";
+    (strings[3] = "copied") = string("twice");
+    strings[4] = std::move(moved);
+    CHECK(string(strings[3]) == "twice" && string(strings[4]) == "moved");
+    CHECK(string(strings[5]) == "5");
+}
+
+void test_arena() {
+#ifdef TREAP_ARENA
+    auto& arena = impl::node_arena<int>::instance();
+    bool thrown = false;
+    try {
+        arena.reserve(numeric_limits<uint32_t>::max());
+    }
+    catch (const bad_alloc&) {
+        thrown = true;
+    }
+    CHECK(thrown);
+    // the arena is still usable afterwards
+    auto values = random_values(1000, 1000);
+    CHECK(to_vector(persistent_treap<int>(values.begin(), values.end())) == values);
+
+    // nodes freed on another thread come back to the arena, and blocks left
+    // without nodes can be handed back to the system and then reused
+    size_t live = arena.live_nodes();
+    auto many = random_values(200000, 1000);
+    auto big = persistent_treap<int>(many.begin(), many.end());
+    CHECK(arena.live_nodes() == live + many.size());
+    async(launch::async, [&big]() { big = persistent_treap<int>(); }).get();
+    CHECK(arena.live_nodes() == live);
+    CHECK(arena.trim() > 0);
+    big = persistent_treap<int>(many.begin(), many.end());
+    CHECK(to_vector(big) == many && arena.live_nodes() == live + many.size());
+#endif
+}
+
+void test_compact() {
+    for (int n : { 0, 1, 100, 5000 }) {
+        auto values = random_values(n, 1000);
+        auto t = persistent_treap<int>(values.begin(), values.end()).push_front(-1).push_back(-2);
+        values.insert(values.begin(), -1);
+        values.push_back(-2);
+        auto compacted = t.compact();
+        CHECK(to_vector(compacted) == values);
+        // perfectly balanced, unless small enough to be a flat block
+        treap_size_t depth = 0;
+        while ((treap_size_t(1) << depth) - 1 < treap_size_t(values.size()))
+            depth++;
+        CHECK(treap_size_t(values.size()) <= persistent_treap<int>::small_threshold || compacted.height() <= depth);
+        // and still an ordinary version to edit
+        auto edited = compacted.insert(values.size() / 2, 7).erase(0);
+        values.insert(values.begin() + values.size() / 2, 7);
+        values.erase(values.begin());
+        CHECK(to_vector(edited) == values);
+        // an edit copies paths and shares the rest of the compacted nodes,
+        // which stay valid after the compacted version itself is gone
+        auto usage = measure_memory(vector<persistent_treap<int>>{ compacted, edited });
+        CHECK(usage.exclusive_bytes[1] <= 2 * size_t(edited.height() + 1) * memory_walk<int>::node_bytes() + 2 * memory_walk<int>::block_bytes(persistent_treap<int>::buffer_capacity));
+        compacted = persistent_treap<int>();
+        CHECK(to_vector(edited) == values);
+    }
+}
+
+void test_canonical() {
+    typedef persistent_treap<int> seq;
+    auto values = random_values(20000, 100);
+    auto table = hash_cons_table<int>();
+    auto a = seq::canonical(values.begin(), values.end(), table);
+    size_t nodes = table.size();
+    CHECK(to_vector(a) == values);
+    // equal contents give the very same nodes, whatever the history
+    CHECK(seq::canonical(values.begin(), values.end(), table).is(a));
+    CHECK(seq(values.begin(), values.end()).push_back(3).pop_back().canonicalize(table).is(a));
+    CHECK(table.size() == nodes);
+
+    // one changed element adds only a path of new nodes
+    auto changed = values;
+    changed[10000] = 777;
+    auto b = seq::canonical(changed.begin(), changed.end(), table);
+    CHECK(to_vector(b) == changed);
+    CHECK(table.size() - nodes < 200);
+
+    // without a table the shape is still the canonical one
+    auto c = seq::canonical(values.begin(), values.end());
+    CHECK(to_vector(c) == values && c.height() == a.height());
+    CHECK(to_vector(a.canonicalize()) == values);
+
+    a = b = c = seq();
+    table.collect();
+    CHECK(table.size() == 0);
+}
+
+void test_summaries() {
+    typedef persistent_treap<weight> seq;
+    auto t = seq();
+    auto model = vector<long long>();
+    for (int i = 0; i < 3000; i++) {
+        long long w = rand() % 100;
+        int pos = rand() % (model.size() + 1);
+        if (rand() % 3) {
+            t = t.push_back(weight{ w });
+            model.push_back(w);
+        }
+        else {
+            t = t.insert(pos, weight{ w });
+            model.insert(model.begin() + pos, w);
+        }
+    }
+    auto prefix = vector<long long>(model.size() + 1);
+    for (size_t i = 0; i < model.size(); i++)
+        prefix[i + 1] = prefix[i] + model[i];
+    for (int round = 0; round < 2000; round++) {
+        int begin = rand() % (model.size() + 1), end = rand() % (model.size() + 1);
+        if (begin > end)
+            swap(begin, end);
+        CHECK(t.summary(begin, end) == prefix[end] - prefix[begin]);
+        long long bound = rand() % (prefix.back() + 10);
+        treap_size_t expected = upper_bound(prefix.begin() + 1, prefix.end(), bound) - prefix.begin() - 1;
+        CHECK(t.find_by_prefix([&](long long sum) { return sum > bound; }) == expected);
+    }
+    CHECK(t.summary() == prefix.back());
+
+    // a range query visits two paths of the tree, not the whole range
+    auto big = seq();
+    for (int i = 0; i < 100000; i++)
+        big = big.push_back(weight{ 1 });
+    treap_size_t height = big.height();
+    for (int round = 0; round < 100; round++) {
+        treap_size_t begin = rand() % 50000, end = begin + rand() % 50000;
+        combines = 0;
+        CHECK(big.summary(begin, end) == end - begin);
+        CHECK(combines <= 4 * height + 2 * seq::buffer_capacity);
+    }
+}
+
+// random text mixing newlines with one to four byte UTF-8 sequences
+string random_text(int pieces) {
+    static const char* alphabet[] = { "a", "bc", "\n", "\xc3\xa9", "\xe2\x82\xac", "\xf0\x9f\x98\x80" };
+    string text;
+    for (int i = 0; i < pieces; i++)
+        text += alphabet[rand() % 6];
+    return text;
+}
+
+// start of the UTF-8 sequence at or after offset
+int codepoint_boundary(const string& text, int offset) {
+    while (offset < int(text.size()) && impl::is_utf8_continuation(text[offset]))
+        offset++;
+    return offset;
+}
+
+// number of chunks, checking that each is within bounds
+// no chunk at either end would fit into its neighbour
+bool ends_absorbed(const rope& r) {
+    auto sizes = vector<size_t>();
+    for (auto current = r.chunks_begin(); current != r.chunks_end(); ++current)
+        sizes.push_back((*current).text.size());
+    size_t n = sizes.size();
+    return n < 2 || (sizes[0] + sizes[1] > size_t(rope::chunk_size) && sizes[n - 2] + sizes[n - 1] > size_t(rope::chunk_size));
+}
+
+treap_size_t chunk_count(const rope& r) {
+    treap_size_t chunks = 0;
+    for (auto current = r.chunks_begin(); current != r.chunks_end(); ++current) {
+        CHECK(!(*current).text.empty() && (*current).text.size() <= size_t(rope::chunk_size));
+        chunks++;
+    }
+    return chunks;
+}
+
+double seconds_for_lookups(const rope& r, int count) {
+    clock_t start = clock();
+    long long sum = 0;
+    for (int i = 0; i < count; i++)
+        sum += r[rand() % r.size()];
+    CHECK(sum != 1);
+    return double(clock() - start) / CLOCKS_PER_SEC;
+}
+
+void test_rope() {
+    string model = random_text(20000);
+    istringstream in(model);
+    auto r = rope::load(in);
+    CHECK(r.str() == model);
+    for (int step = 0; step < 400; step++) {
+        int begin = codepoint_boundary(model, rand() % (model.size() + 1));
+        int end = codepoint_boundary(model, min<int>(model.size(), begin + rand() % (step % 2 ? 3000 : 20)));
+        switch (rand() % 3) {
+        case 0: {
+            string text = random_text(step % 2 ? rand() % 2000 : rand() % 5);
+            r = r.insert(begin, text);
+            model.insert(begin, text);
+            break;
+        }
+        case 1:
+            r = r.erase(begin, end);
+            model.erase(begin, end - begin);
+            break;
+        default: {
+            auto sliced = r.slice(begin, end);
+            CHECK(sliced.str() == model.substr(begin, end - begin));
+            CHECK(ends_absorbed(sliced));
+            CHECK(r.substr(begin, end) == model.substr(begin, end - begin));
+        }
+        }
+        CHECK(r.size() == treap_size_t(model.size()));
+        int offset = rand() % (model.size() + 1);
+        CHECK(r.line_of_offset(offset) == count(model.begin(), model.begin() + offset, '\n'));
+        CHECK(r.codepoint_of_offset(offset) == count_if(model.begin(), model.begin() + offset,
+            [](char c) { return !impl::is_utf8_continuation(c); }));
+        if (offset < int(model.size()))
+            CHECK(r[offset] == model[offset]);
+        int line = rand() % (r.lines() + 1);
+        size_t line_start = 0;
+        for (int i = 0; i < line; i++) {
+            size_t newline = model.find('\n', line_start);
+            line_start = newline == string::npos ? model.size() : newline + 1;
+        }
+        CHECK(r.offset_of_line(line) == treap_size_t(line_start));
+        int codepoint = rand() % (r.codepoints() + 1);
+        int codepoint_start = 0;
+        for (int seen = -1; codepoint_start < int(model.size()); codepoint_start++)
+            if (!impl::is_utf8_continuation(model[codepoint_start]) && ++seen == codepoint)
+                break;
+        CHECK(r.offset_of_codepoint(codepoint) == codepoint_start);
+    }
+    CHECK(r.str() == model);
+    ostringstream out;
+    r.save(out);
+    CHECK(out.str() == model);
+    CHECK((r + rope("tail")).str() == model + "tail");
+    // ranges reaching past the end are clamped, by erase as by slice
+    int half = codepoint_boundary(model, model.size() / 2);
+    CHECK(r.erase(half, r.size() + 100).str() == model.substr(0, half));
+    CHECK(r.slice(half, r.size() + 100).str() == model.substr(half));
+
+    // small edits absorb their neighbours, so chunks stay more than half full
+    CHECK(chunk_count(r) <= 2 * r.size() / rope::chunk_size + 2);
+    auto typed = rope();
+    for (int i = 0; i < 5000; i++)
+        typed = typed.insert(typed.size() / 2, "x");
+    for (int i = 0; i < 4000; i++) {
+        treap_size_t offset = rand() % typed.size();
+        typed = typed.erase(offset, offset + 1);
+    }
+    CHECK(chunk_count(typed) <= 2 * typed.size() / rope::chunk_size + 2);
+
+    // lookups walk one path: fifty times the chunks costs about twice as much
+    istringstream small_in(random_text(40000)), large_in(random_text(2000000));
+    auto small = rope::load(small_in), large = rope::load(large_in);
+    CHECK(seconds_for_lookups(large, 20000) < 10 * seconds_for_lookups(small, 20000));
+}
+
+persistent_treap<char> chars_of(const string& text) {
+    return persistent_treap<char>(text.begin(), text.end());
+}
+
+void test_rolling_hash() {
+    // a two letter alphabet makes long common prefixes likely
+    string model;
+    auto t = persistent_treap<char>();
+    for (int i = 0; i < 3000; i++) {
+        char c = "ab"[rand() % 2];
+        treap_size_t pos = rand() % (model.size() + 1);
+        t = t.insert(pos, c);
+        model.insert(model.begin() + pos, c);
+    }
+    for (int round = 0; round < 300; round++) {
+        treap_size_t begin = rand() % (model.size() + 1), end = rand() % (model.size() + 1);
+        if (begin > end)
+            swap(begin, end);
+        // a substring hashes like the same text built from scratch
+        auto fresh = chars_of(model.substr(begin, end - begin));
+        CHECK(range_hash(t, begin, end) == range_hash(fresh, 0, fresh.size()));
+        treap_size_t other = rand() % (model.size() - (end - begin) + 1);
+        bool equal = model.compare(begin, end - begin, model, other, end - begin) == 0;
+        CHECK(range_equal(t, begin, end, t, other, other + (end - begin)) == equal);
+        treap_size_t expected = 0;
+        while (begin + expected < end && other + expected < treap_size_t(model.size())
+            && model[begin + expected] == model[other + expected])
+            expected++;
+        CHECK(common_prefix(fresh, 0, fresh.size(), t, begin, end) == end - begin);
+        CHECK(common_prefix(t, begin, end, t, other, model.size()) == expected);
+    }
+    auto copy = chars_of(model);
+    CHECK(common_prefix(t, copy) == treap_size_t(model.size()));
+    copy = copy.set(1234, model[1234] == 'a' ? 'b' : 'a');
+    CHECK(common_prefix(t, copy) == 1234);
+    CHECK(!range_equal(t, 0, t.size(), copy, 0, copy.size()));
+}
+
+void test_sorting() {
+    // pairs ordered by key only, so stability shows in the second member
+    typedef pair<int, int> item;
+    auto by_key = [](const item& lhs, const item& rhs) { return lhs.first < rhs.first; };
+    auto model = vector<item>();
+    for (int i = 0; i < 20000; i++)
+        model.push_back(item(rand() % 100, i));
+    auto t = persistent_treap<item>(model.begin(), model.end());
+    CHECK(t.height() <= log_height_bound(t.size()));
+    CHECK(t.sort(0, t.size(), by_key).height() <= log_height_bound(t.size()));
+    for (int round = 0; round < 20; round++) {
+        treap_size_t begin = rand() % (model.size() + 1), end = rand() % (model.size() + 1);
+        if (begin > end)
+            swap(begin, end);
+        auto expected = model;
+        stable_sort(expected.begin() + begin, expected.begin() + end, by_key);
+        CHECK(to_vector(t.sort(begin, end, by_key)) == expected);
+        treap_size_t middle = begin + rand() % (end - begin + 1);
+        expected = model;
+        rotate(expected.begin() + begin, expected.begin() + middle, expected.begin() + end);
+        CHECK(to_vector(t.rotate(begin, middle, end)) == expected);
+    }
+
+    auto lhs = model, rhs = vector<item>();
+    for (int i = 0; i < 10000; i++)
+        rhs.push_back(item(rand() % 100, -i));
+    stable_sort(lhs.begin(), lhs.end(), by_key);
+    stable_sort(rhs.begin(), rhs.end(), by_key);
+    auto merged = vector<item>();
+    merge(lhs.begin(), lhs.end(), rhs.begin(), rhs.end(), back_inserter(merged), by_key);
+    auto sorted_lhs = persistent_treap<item>(lhs.begin(), lhs.end());
+    auto sorted_rhs = persistent_treap<item>(rhs.begin(), rhs.end());
+    CHECK(to_vector(merge_sorted(sorted_lhs, sorted_rhs, by_key)) == merged);
+
+    // the same with forking forced on and off, whatever the hardware
+    for (int depth = 0; depth <= 3; depth++) {
+        auto cells = vector<value_cell<item>>(model.begin(), model.end());
+        auto expected = model;
+        stable_sort(expected.begin(), expected.end(), by_key);
+        impl::parallel_sort<item>(cells.begin(), cells.end(), by_key, depth);
+        CHECK(to_vector(persistent_treap<item>(cells.begin(), cells.end())) == expected);
+        auto forked = impl::merge_sorted(build<item>(lhs.begin(), lhs.end()), build<item>(rhs.begin(), rhs.end()), by_key, depth);
+        CHECK(to_vector(persistent_treap<item>(forked)) == merged);
+    }
+}
+
+void test_log() {
+    string path = "/tmp/treap_log_test." + to_string(getpid());
+    ::unlink(path.c_str());
+    auto base = persistent_treap<int>().push_back(1).push_back(2).push_back(3);
+    auto model = to_vector(base);
+    // the model after every record, for cutting the log short below
+    auto versions = vector<vector<int>>();
+    {
+        treap_log<int> log(path, 7);
+        for (int step = 0; step < 600; step++) {
+            treap_size_t pos = rand() % (model.size() + 1);
+            int val = rand() % 1000;
+            switch (rand() % 6) {
+            case 0:
+                log.insert(pos, val);
+                model.insert(model.begin() + pos, val);
+                break;
+            case 1: {
+                auto values = vector<int>(rand() % 5, val);
+                log.insert(pos, persistent_treap<int>(values.begin(), values.end()));
+                model.insert(model.begin() + pos, values.begin(), values.end());
+                break;
+            }
+            case 2: {
+                treap_size_t end = min(pos + rand() % 4, treap_size_t(model.size()));
+                log.erase(pos, end);
+                model.erase(model.begin() + pos, model.begin() + end);
+                break;
+            }
+            case 3:
+                if (pos == treap_size_t(model.size()))
+                    continue;
+                log.set(pos, val);
+                model[pos] = val;
+                break;
+            case 4:
+                log.push_back(val);
+                model.push_back(val);
+                break;
+            default:
+                log.concat(persistent_treap<int>().push_back(val).push_back(val + 1));
+                model.push_back(val);
+                model.push_back(val + 1);
+            }
+            versions.push_back(model);
+        }
+    }
+    CHECK(to_vector(treap_log<int>::replay(base, path)) == model);
+
+    struct stat info;
+    ::stat(path.c_str(), &info);
+    auto append_bytes = [&](const string& bytes) {
+        int fd = ::open(path.c_str(), O_WRONLY | O_APPEND);
+        CHECK(::write(fd, bytes.data(), bytes.size()) == ssize_t(bytes.size()));
+        ::close(fd);
+    };
+
+    // a zero-filled tail, as left by a crash after the file was extended, is ignored
+    append_bytes(string(64, '\0'));
+    CHECK(to_vector(treap_log<int>::replay(base, path)) == model);
+    CHECK(::truncate(path.c_str(), info.st_size) == 0);
+
+    // so is a record whose checksum matches but whose fields do not fill its body
+    auto body = string(1, char(impl::log_op::erase));
+    impl::log_serializer<int64_t>::write(body, 0);
+    impl::log_serializer<int64_t>::write(body, 1);
+    impl::log_serializer<uint64_t>::write(body, 0);
+    body.push_back('\0');
+    uint32_t length = body.size();
+    uint64_t checksum = impl::log_checksum(body.data(), body.size());
+    append_bytes(string(reinterpret_cast<const char*>(&length), sizeof(length))
+        + string(reinterpret_cast<const char*>(&checksum), sizeof(checksum)) + body);
+    CHECK(to_vector(treap_log<int>::replay(base, path)) == model);
+
+    // and a torn last record
+    CHECK(::truncate(path.c_str(), info.st_size - 1) == 0);
+    CHECK(to_vector(treap_log<int>::replay(base, path)) == versions[versions.size() - 2]);
+    ::unlink(path.c_str());
+    CHECK(treap_log<int>::replay(base, path) == base);
+
+    {
+        treap_log<string> log(path);
+        log.push_back("first");
+        log.insert(0, string("zeroth"));
+        log.set(1, string(300, 'x'));
+    }
+    auto strings = to_vector(treap_log<string>::replay(persistent_treap<string>(), path));
+    CHECK(strings == vector<string>({ "zeroth", string(300, 'x') }));
+    ::unlink(path.c_str());
+}
+
+void test_shm() {
+    string name = "/treap_test." + to_string(getpid());
+    auto model = random_values(5000, 1000);
+    auto t = persistent_treap<int>(model.begin(), model.end());
+    auto shared = t + t.slice(100, 2000);
+    model.insert(model.end(), model.begin() + 100, model.begin() + 2000);
+    {
+        auto published = shm_snapshot<int>::publish(name, shared);
+        // another process reads the same version in place
+        pid_t child = fork();
+        if (child == 0) {
+            bool same = false;
+            {
+                auto attached = shm_snapshot<int>::attach(name);
+                same = attached.size() == treap_size_t(model.size());
+                for (treap_size_t i = 0; same && i < attached.size(); i++)
+                    same = attached[i] == model[i];
+            }
+            _exit(same ? 0 : 1);
+        }
+        int status = 0;
+        waitpid(child, &status, 0);
+        CHECK(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+
+        auto attached = shm_snapshot<int>::attach(name);
+        CHECK(attached.size() == treap_size_t(model.size()));
+        for (int round = 0; round < 100; round++) {
+            treap_size_t index = rand() % model.size();
+            CHECK(attached[index] == model[index]);
+        }
+        auto visited = vector<int>();
+        attached.for_each(300, 4000, [&](int val) { visited.push_back(val); });
+        CHECK(visited == vector<int>(model.begin() + 300, model.begin() + 4000));
+        CHECK(to_vector(attached.materialize()) == model);
+        bool thrown = false;
+        try {
+            attached[model.size()];
+        }
+        catch (const out_of_range&) {
+            thrown = true;
+        }
+        CHECK(thrown);
+    }
+    // the last process to detach removed the name
+    bool thrown = false;
+    try {
+        shm_snapshot<int>::attach(name);
+    }
+    catch (const system_error&) {
+        thrown = true;
+    }
+    CHECK(thrown);
+
+    auto empty = shm_snapshot<int>::publish(name, persistent_treap<int>());
+    CHECK(empty.empty() && empty.materialize().empty());
+    thrown = false;
+    try {
+        empty[0];
+    }
+    catch (const out_of_range&) {
+        thrown = true;
+    }
+    CHECK(thrown);
+}
+
+void test_memory() {
+    typedef persistent_treap<int> seq;
+    auto values = random_values(1000, 100);
+    auto t = seq(values.begin(), values.end());
+    auto usage = measure_memory(vector<seq>{ t });
+    CHECK(usage.objects == 1000 && usage.bytes == 1000 * memory_walk<int>::node_bytes());
+    CHECK(usage.shared_bytes == 0 && usage.exclusive_bytes[0] == usage.bytes);
+
+    // an edit copies one path and shares the rest
+    auto edited = t.set(500, -1);
+    usage = measure_memory(vector<seq>{ t, edited }, true);
+    CHECK(usage.exclusive_bytes[0] == usage.exclusive_bytes[1]);
+    CHECK(usage.exclusive_bytes[1] <= size_t(t.height()) * memory_walk<int>::node_bytes());
+    CHECK(usage.bytes == usage.shared_bytes + usage.exclusive_bytes[0] + usage.exclusive_bytes[1]);
+    CHECK(usage.bytes == usage.objects * memory_walk<int>::node_bytes());
+    CHECK(usage.version_shared_bytes == vector<size_t>({ usage.shared_bytes, usage.shared_bytes }));
+    usage = measure_memory(vector<seq>{ t, t });
+    CHECK(usage.shared_bytes == usage.bytes && usage.exclusive_bytes == vector<size_t>({ 0, 0 }));
+
+    auto small = seq(values.begin(), values.begin() + 10);
+    usage = measure_memory(vector<seq>{ small });
+    CHECK(usage.objects == 2 && usage.bytes == memory_walk<int>::block_bytes(10));
+
+    // out-of-line values are counted once, however many nodes hold them
+    auto items = vector<tracked>();
+    for (long i = 0; i < 100; i++)
+        items.push_back(tracked(i, i, i));
+    auto big = persistent_treap<tracked>(items.begin(), items.end());
+    auto erased = big.erase(10);
+    size_t node = memory_walk<tracked>::node_bytes(), value = memory_walk<tracked>::value_bytes();
+    usage = measure_memory(vector<persistent_treap<tracked>>{ big, erased });
+    CHECK(value > 0);
+    CHECK(usage.bytes == 100 * value + (usage.objects - 100) * node);
+    CHECK(usage.exclusive_bytes[1] % node == 0 && (usage.exclusive_bytes[0] - value) % node == 0);
+}
+
+void test_comparison() {
+    typedef persistent_treap<int> seq;
+    auto values = random_values(3000, 3);
+    auto base = seq(values.begin(), values.end());
+    for (int round = 0; round < 200; round++) {
+        // versions that share most of their structure with base, or none of it
+        auto other = values;
+        treap_size_t pos = rand() % values.size();
+        auto t = base;
+        switch (rand() % 4) {
+        case 0:
+            other[pos] = rand() % 3;
+            t = base.set(pos, other[pos]);
+            break;
+        case 1:
+            other.insert(other.begin() + pos, rand() % 3);
+            t = base.insert(pos, other[pos]);
+            break;
+        case 2:
+            other.resize(pos);
+            t = base.slice(0, pos);
+            break;
+        default:
+            t = seq();
+            for (int val : other)
+                t = t.push_back(val);
+        }
+        treap_size_t expected = std::mismatch(values.begin(), values.begin() + min(values.size(), other.size()), other.begin()).first - values.begin();
+        CHECK(base.mismatch(t) == expected && t.mismatch(base) == expected);
+        CHECK((base == t) == (values == other) && (base != t) == (values != other));
+        CHECK((base < t) == (values < other) && (t < base) == (other < values));
+        CHECK((base <= t) == (values <= other) && (base >= t) == (values >= other));
+        if (values == other)
+            CHECK(base.hash() == t.hash());
+        else
+            CHECK(base.hash() != t.hash());
+    }
+    auto halves = base.slice(0, 1234) + base.slice(1234, base.size());
+    CHECK(halves.hash() == base.hash() && halves == base);
+    CHECK(seq().mismatch(base) == 0 && seq() < base && seq().hash() == seq().hash());
+
+    // a version hashed from several threads at once agrees with itself
+    auto fresh = base.push_back(7);
+    auto hashes = vector<future<uint64_t>>();
+    for (int i = 0; i < 4; i++)
+        hashes.push_back(async(launch::async, [&fresh]() { return fresh.hash(); }));
+    for (auto& result : hashes)
+        CHECK(result.get() == fresh.hash());
+    auto copy = fresh;
+    CHECK(copy.hash() == fresh.hash());
+}
+
+void test_builder() {
+    auto values = random_values(50000, 1000000);
+    for (int parallel = 0; parallel < 2; parallel++) {
+        // a small chunk size so that many chunks are merged
+        treap_builder<int> builder(1000, parallel);
+        for (int i = 0; i < 20000; i++)
+            builder.push_back(values[i]);
+        builder.push_back_tree(async_seeded([&values]() {
+            return build<int>(values.begin() + 20000, values.begin() + 30000);
+        }));
+        for (int i = 30000; i < 50000; i++)
+            builder.push_back(values[i]);
+        auto built = builder.finish();
+        CHECK(to_vector(built) == values);
+        CHECK(built.height() <= log_height_bound(built.size()));
+        CHECK(builder.buffered() == 0 && builder.finish().empty());
+
+        string text;
+        for (int val : values)
+            text += to_string(val) + (val % 7 ? " " : "\n");
+        istringstream in(text);
+        // small blocks cut many numbers in two
+        auto read = read_treap<int>(in, parallel, 1000);
+        CHECK(to_vector(read) == values);
+        CHECK(read.height() <= log_height_bound(read.size()));
+    }
+    istringstream empty("");
+    CHECK(read_treap<int>(empty, true).empty());
+}
+
+int main() {
+    srand(1);
+    test_ordered_set_operations();
+    test_end_operations();
+    test_views();
+    test_cursor();
+    test_apply_batch();
+    test_flat_transitions();
+    test_size_limits();
+    test_value_cells();
+    test_arena();
+    test_compact();
+    test_canonical();
+    test_summaries();
+    test_rope();
+    test_rolling_hash();
+    test_sorting();
+    test_log();
+    test_shm();
+    test_memory();
+    test_comparison();
+    test_builder();
+    if (failures) {
+        cerr << failures << " checks failed" << endl;
+        return 1;
+    }
+    cout << "all tests passed" << endl;
+    return 0;
+}
@@ -0,0 +1,122 @@
+"""Checks the Python side of Treap and PersistentTreap against plain lists.
+
+Needs treap.so next to it: make pytests
+"""
+
+import copy
+import pickle
+import sys
+import unittest
+from array import array
+
+from treap import Treap, PersistentTreap
+
+CONTAINERS = [PersistentTreap, Treap]
+
+# contents with the typecode they are pickled as; None for the list fallback
+CONTENTS = [
+    ([], None),
+    (list(range(-100, 100)), 'b'),
+    (list(range(-1000, 1000)), 'h'),
+    ([2 ** 20, -2 ** 20, 7], 'i'),
+    ([2 ** 40, -2 ** 62, 0], 'q'),
+    ([0.5, -1e300, float('inf')], 'd'),
+    ([2 ** 70, 1], None),
+    ([1, 2.5], None),
+    ([True, 1], None),
+    (['a', (1, 2), None, [3]], None),
+]
+
+
+class PickleTest(unittest.TestCase):
+    def test_round_trip(self):
+        for cls in CONTAINERS:
+            for values, typecode in CONTENTS:
+                t = cls(values)
+                state = t.__getinitargs__()[0]
+                if typecode is None:
+                    self.assertIs(type(state), list)
+                else:
+                    self.assertIsInstance(state, array)
+                    self.assertEqual(state.typecode, typecode)
+                for protocol in range(pickle.HIGHEST_PROTOCOL + 1):
+                    loaded = pickle.loads(pickle.dumps(t, protocol))
+                    self.assertIs(type(loaded), cls)
+                    self.assertEqual(list(loaded), values)
+                    self.assertEqual([type(v) for v in loaded], [type(v) for v in values])
+
+    def test_reference_counts(self):
+        item = ['shared']
+        before = sys.getrefcount(item)
+        for cls in CONTAINERS:
+            t = cls([item, item, 1])
+            for _ in range(10):
+                pickle.loads(pickle.dumps(t))
+            del t
+        self.assertEqual(sys.getrefcount(item), before)
+
+
+class CopyTest(unittest.TestCase):
+    def test_copy_shares_values(self):
+        for cls in CONTAINERS:
+            values = [[i] for i in range(100)]
+            t = cls(values)
+            c = copy.copy(t)
+            self.assertIs(type(c), cls)
+            self.assertEqual(list(c), values)
+            self.assertTrue(all(a is b for a, b in zip(c, t)))
+
+    def test_copy_of_treap_is_independent(self):
+        t = Treap(range(100))
+        c = copy.copy(t)
+        t.append(100)
+        t[0] = -1
+        t.erase(50)
+        self.assertEqual(list(c), list(range(100)))
+        c.append(7)
+        self.assertEqual(len(t), 100)
+
+    def test_deepcopy_copies_values(self):
+        for cls in CONTAINERS:
+            inner = [1, 2]
+            t = cls([inner, inner, [3]])
+            d = copy.deepcopy(t)
+            self.assertIs(type(d), cls)
+            self.assertEqual(list(d), [[1, 2], [1, 2], [3]])
+            self.assertIsNot(d[0], inner)
+            # the memo keeps repeated values one object
+            self.assertIs(d[0], d[1])
+            inner.append(3)
+            self.assertEqual(d[0], [1, 2])
+
+    def test_reference_counts(self):
+        item = [0]
+        before = sys.getrefcount(item)
+        for cls in CONTAINERS:
+            t = cls([item] * 50)
+            copies = [copy.copy(t) for _ in range(5)] + [copy.deepcopy(t) for _ in range(5)]
+            del t
+            self.assertGreater(sys.getrefcount(item), before)
+            del copies
+        self.assertEqual(sys.getrefcount(item), before)
+
+
+class OverflowTest(unittest.TestCase):
+    MAX_SIZE = 2 ** 63 - 1
+
+    def test_growing_past_the_size_limit(self):
+        one, two = PersistentTreap([1]), PersistentTreap([1, 2])
+        half = one * (self.MAX_SIZE // 2)
+        full = half + half + one
+        self.assertEqual(len(full), self.MAX_SIZE)
+        self.assertRaises(OverflowError, lambda: two * (self.MAX_SIZE // 2 + 1))
+        self.assertRaises(OverflowError, lambda: full + one)
+        self.assertRaises(OverflowError, full.append, 0)
+        self.assertRaises(OverflowError, full.insert, 0, 0)
+        self.assertRaises(OverflowError, full.insert, 0, two)
+        self.assertRaises(OverflowError, lambda: full.view() + one.view())
+        self.assertEqual(len(full.pop()), self.MAX_SIZE - 1)
+
+
+if __name__ == '__main__':
+    unittest.main()
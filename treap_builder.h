@@ -0,0 +1,152 @@
+#ifndef _TREAP_BUILDER_H_
+#define _TREAP_BUILDER_H_
+
+#include <deque>
+#include <future>
+#include <istream>
+#include <sstream>
+#include <string>
+#include <thread>
+#include "implicit_treap.h"
+
+// Builds a sequence from input of unknown length in bounded memory. Values
+// are buffered in chunks of chunk_size; every full chunk is built into a
+// tree in O(chunk_size) and merged onto the end of the result in O(log n).
+// With parallel set, chunks are built on other threads, at most one per
+// hardware thread at a time, while the caller goes on producing values;
+// each thread is seeded from the caller, as in the parallel algorithms.
+template <class T>
+class treap_builder {
+public:
+    static const treap_size_t default_chunk_size = 1 << 16;
+
+    treap_builder(treap_size_t chunk_size = default_chunk_size, bool parallel = false)
+        : _ChunkSize(max(chunk_size, treap_size_t(1))), _Parallel(parallel) {
+        _MaxPending = max(thread::hardware_concurrency(), 1u);
+    }
+    treap_builder(const treap_builder&) = delete;
+    treap_builder& operator=(const treap_builder&) = delete;
+
+    void push_back(const T& val) { push_back_cell(value_cell<T>(val)); }
+    void push_back(T&& val) { push_back_cell(value_cell<T>(std::move(val))); }
+
+    // appends a tree built elsewhere, e.g. a chunk parsed on another thread
+    void push_back_tree(future<node_ptr<T>>&& tree);
+
+    // values not yet part of a tree
+    const treap_size_t buffered() const { return _Chunk.size(); }
+
+    // the sequence so far; the builder is left empty
+    persistent_treap<T> finish();
+
+    ~treap_builder() {
+        for (auto& pending : _Pending)
+            if (pending.valid())
+                pending.wait();
+    }
+private:
+    void push_back_cell(value_cell<T>&& val) {
+        _Chunk.push_back(std::move(val));
+        if (treap_size_t(_Chunk.size()) >= _ChunkSize)
+            flush();
+    }
+
+    void flush();
+    void merge_front();
+
+    treap_size_t _ChunkSize;
+    bool _Parallel;
+    unsigned _MaxPending;
+    vector<value_cell<T>> _Chunk;
+    // chunks being built, in order
+    deque<future<node_ptr<T>>> _Pending;
+    node_ptr<T> _Root;
+};
+
+template <class T>
+void treap_builder<T>::flush() {
+    if (_Chunk.empty())
+        return;
+    auto chunk = vector<value_cell<T>>();
+    chunk.reserve(_ChunkSize);
+    swap(chunk, _Chunk);
+    if (!_Parallel) {
+        // trees handed over by push_back_tree come before the chunk
+        while (!_Pending.empty())
+            merge_front();
+        _Root = merge(_Root, build<T>(chunk.begin(), chunk.end()));
+        return;
+    }
+    auto shared_chunk = make_shared<vector<value_cell<T>>>(std::move(chunk));
+    push_back_tree(async_seeded([shared_chunk]() {
+        return build<T>(shared_chunk->begin(), shared_chunk->end());
+    }));
+}
+
+template <class T>
+void treap_builder<T>::push_back_tree(future<node_ptr<T>>&& tree) {
+    // values buffered before the tree go first
+    if (!_Chunk.empty())
+        flush();
+    _Pending.push_back(std::move(tree));
+    while (_Pending.size() > _MaxPending)
+        merge_front();
+}
+
+template <class T>
+void treap_builder<T>::merge_front() {
+    auto tree = _Pending.front().get();
+    _Pending.pop_front();
+    _Root = merge(_Root, tree);
+}
+
+template <class T>
+persistent_treap<T> treap_builder<T>::finish() {
+    flush();
+    while (!_Pending.empty())
+        merge_front();
+    auto result = persistent_treap<T>(_Root);
+    _Root = nullptr;
+    return result;
+}
+
+// Reads whitespace separated values with operator>> until the end of in.
+// With parallel set, in is read in blocks of about chunk_bytes cut at
+// whitespace, and every block is parsed and built on its own thread.
+template <class T>
+persistent_treap<T> read_treap(istream& in, bool parallel = false, size_t chunk_bytes = 1 << 20) {
+    treap_builder<T> builder(treap_builder<T>::default_chunk_size, parallel);
+    if (!parallel) {
+        T val;
+        while (in >> val)
+            builder.push_back(std::move(val));
+        return builder.finish();
+    }
+    string carry;
+    auto block = vector<char>(max(chunk_bytes, size_t(1)));
+    while (in) {
+        in.read(block.data(), block.size());
+        auto text = make_shared<string>(std::move(carry));
+        text->append(block.data(), in.gcount());
+        carry.clear();
+        // a value cut by the block boundary moves to the next block
+        if (in) {
+            size_t cut = text->find_last_of(" \t\n\r\f\v");
+            if (cut == string::npos)
+                cut = 0;
+            carry.assign(*text, cut, string::npos);
+            text->resize(cut);
+        }
+        builder.push_back_tree(async_seeded([text]() {
+            istringstream parsed(*text);
+            auto cells = vector<value_cell<T>>();
+            T val;
+            while (parsed >> val)
+                cells.push_back(value_cell<T>(std::move(val)));
+            return build<T>(cells.begin(), cells.end());
+        }));
+    }
+    return builder.finish();
+}
+
+#endif
@@ -0,0 +1,245 @@
+#ifndef _TREAP_LOG_H_
+#define _TREAP_LOG_H_
+
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <system_error>
+#include <fcntl.h>
+#include <unistd.h>
+#include "implicit_treap.h"
+
+namespace impl {
+
+// Encodes log payloads. Trivially copyable types are written as raw bytes;
+// specialize for anything else.
+template <class T, class Enable = void>
+struct log_serializer;
+
+template <class T>
+struct log_serializer<T, typename enable_if<is_trivially_copyable<T>::value>::type> {
+    static void write(string& out, const T& val) {
+        out.append(reinterpret_cast<const char*>(&val), sizeof(T));
+    }
+    static bool read(const char*& in, const char* end, T& val) {
+        if (size_t(end - in) < sizeof(T))
+            return false;
+        memcpy(&val, in, sizeof(T));
+        in += sizeof(T);
+        return true;
+    }
+};
+
+template <>
+struct log_serializer<string> {
+    static void write(string& out, const string& val) {
+        log_serializer<uint64_t>::write(out, val.size());
+        out += val;
+    }
+    static bool read(const char*& in, const char* end, string& val) {
+        uint64_t length;
+        if (!log_serializer<uint64_t>::read(in, end, length) || uint64_t(end - in) < length)
+            return false;
+        val.assign(in, length);
+        in += length;
+        return true;
+    }
+};
+
+enum class log_op : uint8_t { insert = 1, erase = 2, set = 3, concat = 4 };
+
+inline uint64_t log_checksum(const char* data, size_t length) {
+    uint64_t result = length;
+    for (size_t i = 0; i < length; i++)
+        result = mix_hash(result ^ static_cast<unsigned char>(data[i]));
+    return result;
+}
+
+inline void log_write_all(int fd, const char* data, size_t length) {
+    while (length > 0) {
+        ssize_t written = ::write(fd, data, length);
+        if (written < 0) {
+            if (errno == EINTR)
+                continue;
+            throw system_error(errno, system_category(), "treap_log write");
+        }
+        data += written;
+        length -= written;
+    }
+}
+
+} // namespace impl
+
+// Append-only binary log of edits to a sequence. Every record is
+//     [u32 body length][u64 checksum][u8 op][i64 begin][i64 end][u64 count][values]
+// and records are written and fsync'ed in groups of sync_every, or on commit().
+// Replay stops at the first torn, corrupt or zero-filled record.
+template <class T, class Serializer = impl::log_serializer<T>>
+class treap_log {
+public:
+    treap_log(const string& path, size_t sync_every = 1) : _SyncEvery(max(sync_every, size_t(1))), _Pending(0) {
+        _Fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND, 0644);
+        if (_Fd < 0)
+            throw system_error(errno, system_category(), "treap_log open " + path);
+    }
+    treap_log(const treap_log&) = delete;
+    treap_log& operator=(const treap_log&) = delete;
+
+    void insert(treap_size_t pos, const T& val) { append(impl::log_op::insert, pos, pos, &val, &val + 1); }
+    void insert(treap_size_t pos, const persistent_treap<T>& values) {
+        append(impl::log_op::insert, pos, pos, values.cbegin(), values.cend());
+    }
+    void erase(treap_size_t begin, treap_size_t end) { append(impl::log_op::erase, begin, end, (const T*)nullptr, (const T*)nullptr); }
+    void set(treap_size_t index, const T& val) { append(impl::log_op::set, index, index + 1, &val, &val + 1); }
+    void push_back(const T& val) { append(impl::log_op::concat, 0, 0, &val, &val + 1); }
+    void concat(const persistent_treap<T>& values) {
+        append(impl::log_op::concat, 0, 0, values.cbegin(), values.cend());
+    }
+
+    // writes all buffered records and waits until they are on disk
+    void commit();
+
+    // base with every complete record of the log at path applied in order
+    static persistent_treap<T> replay(const persistent_treap<T>& base, const string& path);
+
+    ~treap_log() {
+        try {
+            commit();
+        }
+        catch (...) { }
+        ::close(_Fd);
+    }
+private:
+    template <class TIter>
+    void append(impl::log_op op, treap_size_t begin, treap_size_t end, TIter values_begin, TIter values_end);
+
+    static const size_t header_size = sizeof(uint32_t) + sizeof(uint64_t);
+    // op, begin, end and count
+    static const size_t min_body_size = sizeof(uint8_t) + 2 * sizeof(int64_t) + sizeof(uint64_t);
+
+    int _Fd;
+    size_t _SyncEvery;
+    size_t _Pending;
+    string _Buffer;
+};
+
+template <class T, class Serializer>
+template <class TIter>
+void treap_log<T, Serializer>::append(impl::log_op op, treap_size_t begin, treap_size_t end, TIter values_begin, TIter values_end) {
+    size_t start = _Buffer.size();
+    _Buffer.append(header_size, '\0');
+    _Buffer.push_back(static_cast<char>(op));
+    impl::log_serializer<int64_t>::write(_Buffer, begin);
+    impl::log_serializer<int64_t>::write(_Buffer, end);
+    size_t count_at = _Buffer.size();
+    impl::log_serializer<uint64_t>::write(_Buffer, 0);
+    uint64_t count = 0;
+    for (; values_begin != values_end; ++values_begin, ++count)
+        Serializer::write(_Buffer, *values_begin);
+    memcpy(&_Buffer[count_at], &count, sizeof(count));
+
+    uint32_t length = _Buffer.size() - start - header_size;
+    uint64_t checksum = impl::log_checksum(_Buffer.data() + start + header_size, length);
+    memcpy(&_Buffer[start], &length, sizeof(length));
+    memcpy(&_Buffer[start + sizeof(length)], &checksum, sizeof(checksum));
+    if (++_Pending >= _SyncEvery)
+        commit();
+}
+
+template <class T, class Serializer>
+void treap_log<T, Serializer>::commit() {
+    if (_Buffer.empty())
+        return;
+    impl::log_write_all(_Fd, _Buffer.data(), _Buffer.size());
+    if (::fsync(_Fd) < 0)
+        throw system_error(errno, system_category(), "treap_log fsync");
+    _Buffer.clear();
+    _Pending = 0;
+}
+
+template <class T, class Serializer>
+persistent_treap<T> treap_log<T, Serializer>::replay(const persistent_treap<T>& base, const string& path) {
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        if (errno == ENOENT)
+            return base;
+        throw system_error(errno, system_category(), "treap_log open " + path);
+    }
+    string data;
+    char chunk[1 << 16];
+    for (;;) {
+        ssize_t got = ::read(fd, chunk, sizeof(chunk));
+        if (got < 0 && errno == EINTR)
+            continue;
+        if (got < 0) {
+            ::close(fd);
+            throw system_error(errno, system_category(), "treap_log read " + path);
+        }
+        if (got == 0)
+            break;
+        data.append(chunk, got);
+    }
+    ::close(fd);
+
+    // Edits are collected into one batch while each starts at or after the
+    // end of the previous one; positions are translated back to the version
+    // the batch is applied to by the total size change of the batch so far.
+    auto result = base;
+    auto batch = vector<treap_edit<T>>();
+    treap_size_t shift = 0, batch_end = 0;
+    auto flush = [&]() {
+        if (!batch.empty())
+            result = result.apply_batch(batch);
+        batch.clear();
+        shift = batch_end = 0;
+    };
+
+    const char* current = data.data();
+    const char* data_end = current + data.size();
+    while (size_t(data_end - current) >= header_size) {
+        uint32_t length;
+        uint64_t checksum;
+        memcpy(&length, current, sizeof(length));
+        memcpy(&checksum, current + sizeof(length), sizeof(checksum));
+        const char* body = current + header_size;
+        // a zero-filled tail has a matching checksum for length 0, so a body
+        // too short for the fixed fields ends the log like a torn record
+        if (length < min_body_size || size_t(data_end - body) < length || impl::log_checksum(body, length) != checksum)
+            break;
+        current = body + length;
+
+        // every field must parse and use up the body exactly, and the range
+        // must lie within the sequence, or the rest of the log is not trusted
+        int64_t begin, end;
+        uint64_t count;
+        const char* in = body + 1;
+        const char* body_end = body + length;
+        auto op = static_cast<impl::log_op>(body[0]);
+        bool valid = op >= impl::log_op::insert && op <= impl::log_op::concat
+            && impl::log_serializer<int64_t>::read(in, body_end, begin)
+            && impl::log_serializer<int64_t>::read(in, body_end, end)
+            && impl::log_serializer<uint64_t>::read(in, body_end, count);
+        auto values = persistent_treap<T>();
+        for (uint64_t i = 0; valid && i < count; i++) {
+            T val;
+            valid = Serializer::read(in, body_end, val);
+            if (valid)
+                values = values.push_back(std::move(val));
+        }
+        if (op == impl::log_op::concat)
+            begin = end = result.size() + shift;
+        if (!valid || in != body_end || begin < 0 || begin > end || end > result.size() + shift)
+            break;
+
+        if (begin < batch_end)
+            flush();
+        batch.push_back(treap_edit<T>{ treap_size_t(begin - shift), treap_size_t(end - shift), values });
+        shift += values.size() - (end - begin);
+        batch_end = begin + values.size();
+    }
+    flush();
+    return result;
+}
+
+#endif
@@ -0,0 +1,255 @@
+#ifndef _TREAP_SHM_H_
+#define _TREAP_SHM_H_
+
+#include <atomic>
+#include <cerrno>
+#include <cstdint>
+#include <new>
+#include <stdexcept>
+#include <string>
+#include <system_error>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "implicit_treap.h"
+
+namespace impl {
+
+// Nodes in a shared segment refer to each other by index into the node
+// array, so the segment can be mapped at any address. Index 0 is null.
+template <class T>
+struct shm_node {
+    T val;
+    treap_size_t size;
+    uint64_t left, right;
+};
+
+struct shm_header {
+    static const uint64_t magic_value = 0x74726561702d7368ULL;
+
+    // stored last with release order, so a reader that sees it sees the rest
+    atomic<uint64_t> magic;
+    uint64_t value_size;
+    uint64_t node_count;
+    uint64_t root;
+    // processes holding the segment open; the last one to leave unlinks it
+    atomic<uint32_t> attached;
+};
+
+template <class T>
+const size_t shm_nodes_offset() {
+    return (sizeof(shm_header) + alignof(shm_node<T>) - 1) / alignof(shm_node<T>) * alignof(shm_node<T>);
+}
+
+// copies the distinct nodes of tree into nodes in post-order, each shared subtree once
+template <class T>
+uint64_t shm_write_nodes(node_ptr<T> tree, shm_node<T>* nodes, uint64_t& next, unordered_map<const node<T>*, uint64_t>& written) {
+    if (!tree)
+        return 0;
+    auto found = written.find(tree.get());
+    if (found != written.end())
+        return found->second;
+    uint64_t left = shm_write_nodes(tree->left(), nodes, next, written);
+    uint64_t right = shm_write_nodes(tree->right(), nodes, next, written);
+    nodes[next] = shm_node<T>{ tree->val(), tree->size(), left, right };
+    return written[tree.get()] = next++;
+}
+
+template <class T>
+void shm_count_nodes(node_ptr<T> tree, unordered_map<const node<T>*, uint64_t>& seen) {
+    if (!tree || !seen.emplace(tree.get(), 0).second)
+        return;
+    shm_count_nodes(tree->left(), seen);
+    shm_count_nodes(tree->right(), seen);
+}
+
+} // namespace impl
+
+// Read-only version of a sequence in a POSIX shared memory segment, for
+// processes that all read the same data. A writer publishes a version under
+// a name; readers attach to it by name and query it in place, without
+// copying. The segment is unlinked when the last process holding it
+// detaches. A process that dies while attached keeps its version alive.
+template <class T>
+class shm_snapshot {
+    static_assert(is_trivially_copyable<T>::value, "shm_snapshot needs trivially copyable values");
+public:
+    // name follows shm_open rules, e.g. "/sequence.42"; fails if it exists
+    static shm_snapshot publish(const string& name, const persistent_treap<T>& t);
+    static shm_snapshot attach(const string& name);
+
+    shm_snapshot(shm_snapshot&& rhs) : _Name(std::move(rhs._Name)), _Base(rhs._Base), _Length(rhs._Length) {
+        rhs._Base = nullptr;
+    }
+    shm_snapshot(const shm_snapshot&) = delete;
+    shm_snapshot& operator=(const shm_snapshot&) = delete;
+
+    const treap_size_t size() const { return _Base ? size_of(header()->root) : 0; }
+    const bool empty() const { return size() == 0; }
+
+    const T& operator[](treap_size_t index) const;
+
+    // calls f on the elements of [begin, end) in order
+    template <class F>
+    void for_each(treap_size_t begin, treap_size_t end, F f) const;
+
+    // private heap copy with the same shape and sharing, for a process that wants to edit
+    persistent_treap<T> materialize() const;
+
+    ~shm_snapshot() {
+        detach();
+    }
+private:
+    shm_snapshot(const string& name, void* base, size_t length) : _Name(name), _Base(base), _Length(length) { }
+
+    impl::shm_header* header() const { return static_cast<impl::shm_header*>(_Base); }
+    const impl::shm_node<T>* node(uint64_t index) const {
+        return index ? reinterpret_cast<const impl::shm_node<T>*>(static_cast<char*>(_Base) + impl::shm_nodes_offset<T>()) + index : nullptr;
+    }
+    const treap_size_t size_of(uint64_t index) const { return index ? node(index)->size : 0; }
+
+    void detach();
+
+    string _Name;
+    void* _Base;
+    size_t _Length;
+};
+
+template <class T>
+shm_snapshot<T> shm_snapshot<T>::publish(const string& name, const persistent_treap<T>& t) {
+    auto tree = t.tree();
+    auto written = unordered_map<const impl::node<T>*, uint64_t>();
+    impl::shm_count_nodes(tree, written);
+    // node 0 stands for null
+    size_t length = impl::shm_nodes_offset<T>() + (written.size() + 1) * sizeof(impl::shm_node<T>);
+    written.clear();
+
+    int fd = shm_open(name.c_str(), O_RDWR | O_CREAT | O_EXCL, 0600);
+    if (fd < 0)
+        throw system_error(errno, system_category(), "shm_snapshot publish " + name);
+    if (ftruncate(fd, length) < 0) {
+        int error = errno;
+        ::close(fd);
+        shm_unlink(name.c_str());
+        throw system_error(error, system_category(), "shm_snapshot publish " + name);
+    }
+    void* base = mmap(nullptr, length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    int error = errno;
+    ::close(fd);
+    if (base == MAP_FAILED) {
+        shm_unlink(name.c_str());
+        throw system_error(error, system_category(), "shm_snapshot publish " + name);
+    }
+
+    auto nodes = reinterpret_cast<impl::shm_node<T>*>(static_cast<char*>(base) + impl::shm_nodes_offset<T>());
+    uint64_t next = 1;
+    auto header = new (base) impl::shm_header();
+    header->root = impl::shm_write_nodes(tree, nodes, next, written);
+    header->node_count = next - 1;
+    header->value_size = sizeof(T);
+    header->attached.store(1, memory_order_relaxed);
+    header->magic.store(impl::shm_header::magic_value, memory_order_release);
+    return shm_snapshot(name, base, length);
+}
+
+template <class T>
+shm_snapshot<T> shm_snapshot<T>::attach(const string& name) {
+    int fd = shm_open(name.c_str(), O_RDWR, 0);
+    if (fd < 0)
+        throw system_error(errno, system_category(), "shm_snapshot attach " + name);
+    struct stat info;
+    if (fstat(fd, &info) < 0 || size_t(info.st_size) < sizeof(impl::shm_header)) {
+        ::close(fd);
+        throw system_error(EINVAL, system_category(), "shm_snapshot attach " + name);
+    }
+    size_t length = info.st_size;
+    void* base = mmap(nullptr, length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    int error = errno;
+    ::close(fd);
+    if (base == MAP_FAILED)
+        throw system_error(error, system_category(), "shm_snapshot attach " + name);
+
+    auto header = static_cast<impl::shm_header*>(base);
+    bool valid = header->magic.load(memory_order_acquire) == impl::shm_header::magic_value && header->value_size == sizeof(T);
+    // a count of zero means the version is being reclaimed and must not be revived
+    uint32_t attached = header->attached.load(memory_order_relaxed);
+    while (valid && attached > 0 && !header->attached.compare_exchange_weak(attached, attached + 1, memory_order_acq_rel))
+        ;
+    if (!valid || attached == 0) {
+        munmap(base, length);
+        throw system_error(ENOENT, system_category(), "shm_snapshot attach " + name);
+    }
+    return shm_snapshot(name, base, length);
+}
+
+template <class T>
+void shm_snapshot<T>::detach() {
+    if (!_Base)
+        return;
+    if (header()->attached.fetch_sub(1, memory_order_acq_rel) == 1)
+        shm_unlink(_Name.c_str());
+    munmap(_Base, _Length);
+    _Base = nullptr;
+}
+
+template <class T>
+const T& shm_snapshot<T>::operator[](treap_size_t index) const {
+    if (index < 0 || index >= size())
+        throw out_of_range("shm_snapshot: index out of range");
+    auto current = node(header()->root);
+    while (size_of(current->left) != index) {
+        if (index < size_of(current->left)) {
+            current = node(current->left);
+        }
+        else {
+            index -= size_of(current->left) + 1;
+            current = node(current->right);
+        }
+    }
+    return current->val;
+}
+
+template <class T>
+template <class F>
+void shm_snapshot<T>::for_each(treap_size_t begin, treap_size_t end, F f) const {
+    // explicit stack of the nodes whose left part is done, as in node_iterator
+    auto path = vector<const impl::shm_node<T>*>();
+    auto current = _Base ? node(header()->root) : nullptr;
+    treap_size_t pos = begin;
+    while (current) {
+        treap_size_t left_size = size_of(current->left);
+        if (pos < left_size) {
+            path.push_back(current);
+            current = node(current->left);
+        }
+        else if (pos == left_size) {
+            path.push_back(current);
+            break;
+        }
+        else {
+            pos -= left_size + 1;
+            current = node(current->right);
+        }
+    }
+    for (treap_size_t count = begin; count < end && !path.empty(); count++) {
+        current = path.back();
+        path.pop_back();
+        f(current->val);
+        for (auto next = node(current->right); next; next = node(next->left))
+            path.push_back(next);
+    }
+}
+
+template <class T>
+persistent_treap<T> shm_snapshot<T>::materialize() const {
+    if (!_Base)
+        return persistent_treap<T>();
+    // nodes were written in post-order, so children always come first
+    auto built = vector<node_ptr<T>>(header()->node_count + 1);
+    for (uint64_t i = 1; i <= header()->node_count; i++)
+        built[i] = make_node<T>(node(i)->val, built[node(i)->left], built[node(i)->right]);
+    return persistent_treap<T>(built[header()->root]);
+}
+
+#endif
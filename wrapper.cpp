@@ -1,4 +1,5 @@
 #include "implicit_treap.h"
+#include "treap_builder.h"
 #include <boost/python.hpp>
 #include <boost/python/slice.hpp>
 #include <string>
@@ -11,6 +12,7 @@ typedef persistent_treap<PyObject*> PersistentTreap;
 typedef node_iterator<PyObject*> PersistentTreapIterator;
 typedef treap<PyObject*> Treap;
 typedef node_iterator<PyObject*> TreapIterator;
+typedef persistent_treap_view<PyObject*> PersistentTreapView;
 
 inline object pass_through(object const& o) { return o; }
 
@@ -60,11 +62,15 @@ string persistent_treap___str__(const PersistentTreap *t) {
     return "persistent_treap(" + containter___str__<PersistentTreap>(t) + ")";
 }
 
+string persistent_treap_view___str__(const PersistentTreapView *t) {
+    return "persistent_treap_view(" + containter___str__<PersistentTreapView>(t) + ")";
+}
+
 string treap___str__(const Treap* t) {
     return "treap(" + containter___str__<Treap>(t) + ")";
 }
 
-PersistentTreap persistent_treap_pop(const PersistentTreap *t, long long pos = -1) {
+PersistentTreap persistent_treap_pop(const PersistentTreap *t, treap_size_t pos = -1) {
     if (pos < 0) { 
         return t->pop_back();
     }
@@ -72,9 +78,10 @@ PersistentTreap persistent_treap_pop(const PersistentTreap *t, long long pos = -
 }
 BOOST_PYTHON_FUNCTION_OVERLOADS(persistent_treap_pop_overloads, persistent_treap_pop, 1, 2)
 
-void treap_pop(Treap *t, long long pos = -1) {
+void treap_pop(Treap *t, treap_size_t pos = -1) {
     if (pos < 0) { 
         t->pop_back();
+        return;
     }
     t->erase(pos);
 }
@@ -118,8 +125,8 @@ PersistentTreapIterator persistent_treap___iter__(const PersistentTreap *self) {
     return self->cbegin();
 }
 
-PyObject* treap___setitem__(Treap *self, treap_size_t pos, PyObject* value) {
-    return (*self)[pos] = value;
+void treap___setitem__(Treap *self, treap_size_t pos, PyObject* value) {
+    (*self)[pos] = value;
 }
 
 class pyiter {
@@ -176,7 +183,7 @@ public:
 
     const pyiter end() const {
         auto result = pyiter(*this);
-        Py_DECREF(result._Object);
+        Py_XDECREF(result._Object);
         result._Object = nullptr;
         return result;
     }
@@ -194,21 +201,205 @@ private:
 
 template <typename TCont>
 shared_ptr<TCont> container___init__(PyObject *iterable) {
-    auto begin = pyiter(iterable);
-    auto end = begin.end();
-    return make_shared<TCont>(begin, end);
+    treap_builder<PyObject*> builder;
+    // the iterator lets go of each value once past it, so the values of the
+    // chunk being buffered are kept alive here until their nodes own them
+    auto buffered = vector<object>();
+    auto it = pyiter(iterable);
+    auto end = it.end();
+    for (; it != end; ++it) {
+        buffered.push_back(object(handle<>(borrowed(*it))));
+        builder.push_back(*it);
+        if (builder.buffered() == 0)
+            buffered.clear();
+    }
+    return make_shared<TCont>(builder.finish());
 }
 
 shared_ptr<PersistentTreap> persistent_treap_from_treap(const Treap& t) {
     return make_shared<PersistentTreap>(t);
 }
 
+shared_ptr<PersistentTreapView> persistent_treap_view_from_persistent_treap(const PersistentTreap& t) {
+    return make_shared<PersistentTreapView>(t);
+}
+
 shared_ptr<Treap> treap_from_persistent_treap(const PersistentTreap& t) {
     return make_shared<Treap>(t);
 }
 
+template <typename TNum>
+object typed_array(const char* typecode, const vector<TNum>& vals) {
+    object result = import("array").attr("array")(typecode);
+    const char* data = reinterpret_cast<const char*>(vals.data());
+    result.attr("frombytes")(object(handle<>(PyBytes_FromStringAndSize(data, vals.size() * sizeof(TNum)))));
+    return result;
+}
+
+// Pickled form of a container: an array.array of the narrowest machine type
+// when every element is exactly an int fitting in 64 bits, or exactly a
+// float, and a plain list otherwise. Both are iterables the constructors accept.
+template <typename TCont>
+object container_bulk_state(const TCont& t) {
+    auto vals = vector<PyObject*>();
+    vals.reserve(t.size());
+    for (auto current = t.cbegin(); !current.is_end(); ++current)
+        vals.push_back(*current); // the iterator hands out new references
+    bool all_ints = !vals.empty(), all_floats = !vals.empty();
+    auto ints = vector<long long>();
+    auto floats = vector<double>();
+    for (auto val : vals) {
+        int overflow = 0;
+        all_ints = all_ints && PyLong_CheckExact(val) && (ints.push_back(PyLong_AsLongLongAndOverflow(val, &overflow)), !overflow);
+        all_floats = all_floats && PyFloat_CheckExact(val) && (floats.push_back(PyFloat_AS_DOUBLE(val)), true);
+    }
+    if (all_ints || all_floats) {
+        for (auto val : vals)
+            Py_DECREF(val);
+        if (all_floats)
+            return typed_array("d", floats);
+        auto range = minmax_element(ints.begin(), ints.end());
+        if (*range.first >= numeric_limits<int8_t>::min() && *range.second <= numeric_limits<int8_t>::max())
+            return typed_array("b", vector<int8_t>(ints.begin(), ints.end()));
+        if (*range.first >= numeric_limits<int16_t>::min() && *range.second <= numeric_limits<int16_t>::max())
+            return typed_array("h", vector<int16_t>(ints.begin(), ints.end()));
+        if (*range.first >= numeric_limits<int32_t>::min() && *range.second <= numeric_limits<int32_t>::max())
+            return typed_array("i", vector<int32_t>(ints.begin(), ints.end()));
+        return typed_array("q", ints);
+    }
+    PyObject* list = PyList_New(vals.size());
+    for (size_t i = 0; i < vals.size(); i++)
+        PyList_SET_ITEM(list, i, vals[i]);
+    return object(handle<>(list));
+}
+
+template <typename TCont>
+struct container_pickle_suite : pickle_suite {
+    static boost::python::tuple getinitargs(const TCont& t) {
+        return boost::python::make_tuple(container_bulk_state(t));
+    }
+};
+
+// values are deep-copied once each; the tree itself is reused as is
+PersistentTreap persistent_treap_deepcopy(const PersistentTreap& t, dict memo) {
+    object deepcopy = import("copy").attr("deepcopy");
+    auto copies = vector<object>(); // keep the copies alive until the nodes own them
+    return t.map_values([&](PyObject* val) {
+        copies.push_back(deepcopy(object(handle<>(borrowed(val))), memo));
+        return copies.back().ptr();
+    });
+}
+
+PersistentTreap persistent_treap___copy__(const PersistentTreap& t) {
+    return t;
+}
+
+PersistentTreap persistent_treap___deepcopy__(const PersistentTreap& t, dict memo) {
+    return persistent_treap_deepcopy(t, memo);
+}
+
+Treap treap___copy__(const Treap& t) {
+    return Treap(t.freeze());
+}
+
+Treap treap___deepcopy__(const Treap& t, dict memo) {
+    return Treap(persistent_treap_deepcopy(t.freeze(), memo));
+}
+
+bool py_equal(PyObject* lhs, PyObject* rhs) {
+    if (lhs == rhs)
+        return true;
+    int result = PyObject_RichCompareBool(lhs, rhs, Py_EQ);
+    if (result < 0)
+        throw_error_already_set();
+    return result;
+}
+
+uint64_t py_hash(PyObject* val) {
+    Py_hash_t result = PyObject_Hash(val);
+    if (result == -1 && PyErr_Occurred())
+        throw_error_already_set();
+    return result;
+}
+
+// compares values like list does: the first pair that is not equal decides,
+// or the sizes if one is a prefix of the other
+object persistent_treap_compare(const PersistentTreap& lhs, const PersistentTreap& rhs, int op) {
+    treap_size_t pos = lhs.mismatch(rhs, py_equal);
+    if (pos == lhs.size() || pos == rhs.size()) {
+        treap_size_t lhs_size = lhs.size(), rhs_size = rhs.size();
+        switch (op) {
+            case Py_EQ: return object(lhs_size == rhs_size);
+            case Py_NE: return object(lhs_size != rhs_size);
+            case Py_LT: return object(lhs_size < rhs_size);
+            case Py_LE: return object(lhs_size <= rhs_size);
+            case Py_GT: return object(lhs_size > rhs_size);
+            default: return object(lhs_size >= rhs_size);
+        }
+    }
+    if (op == Py_EQ)
+        return object(false);
+    if (op == Py_NE)
+        return object(true);
+    // operator[] returns new references
+    object lhs_val = object(handle<>(lhs[pos]));
+    object rhs_val = object(handle<>(rhs[pos]));
+    return object(handle<>(PyObject_RichCompare(lhs_val.ptr(), rhs_val.ptr(), op)));
+}
+
+template <int Op>
+object persistent_treap_richcompare(const PersistentTreap& lhs, const PersistentTreap& rhs) {
+    return persistent_treap_compare(lhs, rhs, Op);
+}
+
+template <int Op>
+object treap_richcompare(const Treap& lhs, const Treap& rhs) {
+    return persistent_treap_compare(lhs.freeze(), rhs.freeze(), Op);
+}
+
+Py_hash_t persistent_treap___hash__(const PersistentTreap& t) {
+    return t.hash(py_hash);
+}
+
+// memory of the given versions as a dict; Treap items are measured as their current version
+dict treap_memory_usage(object versions, bool per_version_shared = false) {
+    auto measured = vector<PersistentTreap>();
+    for (stl_input_iterator<object> it(versions), end; it != end; ++it) {
+        extract<const PersistentTreap&> persistent(*it);
+        if (persistent.check())
+            measured.push_back(persistent());
+        else
+            measured.push_back(extract<const Treap&>(*it)().freeze());
+    }
+    auto usage = measure_memory(measured, per_version_shared);
+    dict result;
+    result["objects"] = usage.objects;
+    result["bytes"] = usage.bytes;
+    result["shared_bytes"] = usage.shared_bytes;
+    list exclusive, shared;
+    for (size_t i = 0; i < usage.exclusive_bytes.size(); i++)
+        exclusive.append(usage.exclusive_bytes[i]);
+    result["exclusive_bytes"] = exclusive;
+    if (per_version_shared) {
+        for (size_t i = 0; i < usage.version_shared_bytes.size(); i++)
+            shared.append(usage.version_shared_bytes[i]);
+        result["version_shared_bytes"] = shared;
+    }
+    return result;
+}
+
+BOOST_PYTHON_FUNCTION_OVERLOADS(treap_memory_usage_overloads, treap_memory_usage, 1, 2)
+
+void translate_length_error(const length_error& e) {
+    PyErr_SetString(PyExc_OverflowError, e.what());
+}
+
 BOOST_PYTHON_MODULE(treap)
 {
+    register_exception_translator<length_error>(translate_length_error);
+    def("memory_usage", treap_memory_usage, treap_memory_usage_overloads(args("versions", "per_version_shared"),
+        "Bytes held by the nodes of the given versions, counting shared structure once."));
+
     //class_<PersistentTreapIterator>("PersistentTreapIterator")
         //.def("__next__", persistent_treap_iterator___next__)
         //.def("__iter__", persistent_treap_iterator___iter__)
@@ -218,12 +409,17 @@ BOOST_PYTHON_MODULE(treap)
         
     iterator_wrapper<PersistentTreap::const_iterator>().wrap("TreapIterator");
 
+    PersistentTreap (PersistentTreap::*persistent_treap_push_back)(PyObject* const&) const = &PersistentTreap::push_back;
+    PersistentTreap (PersistentTreap::*persistent_treap_set)(treap_size_t, PyObject* const&) const = &PersistentTreap::set;
     PersistentTreap (PersistentTreap::*persistent_treap_insert_element)(treap_size_t, PyObject* const&) const = &PersistentTreap::insert;
     PersistentTreap (PersistentTreap::*persistent_treap_insert_treap)(treap_size_t, const PersistentTreap&) const = &PersistentTreap::insert;
 
     PersistentTreap (PersistentTreap::*persistent_treap_erase_single)(treap_size_t) const = &PersistentTreap::erase;
     PersistentTreap (PersistentTreap::*persistent_treap_erase_range)(treap_size_t, treap_size_t) const = &PersistentTreap::erase;
 
+    PersistentTreapView (PersistentTreap::*persistent_treap_view_whole)() const = &PersistentTreap::view;
+    PersistentTreapView (PersistentTreap::*persistent_treap_view_range)(treap_size_t, treap_size_t) const = &PersistentTreap::view;
+
     
     class_<PersistentTreap>("PersistentTreap")
         .def("__init__", make_constructor(container___init__<PersistentTreap>))
@@ -232,7 +428,7 @@ BOOST_PYTHON_MODULE(treap)
         .def("__str__", persistent_treap___str__)
         .def("__repr__", persistent_treap___str__)
         .def("__iter__", &PersistentTreap::cbegin)
-        .def("append", &PersistentTreap::push_back)
+        .def("append", persistent_treap_push_back)
         .def("pop", &persistent_treap_pop, persistent_treap_pop_overloads(args("self", "i"), "pop"))
         .def("__getitem__", &PersistentTreap::operator[], return_value_policy<copy_const_reference>())
         .def("__getitem__", container_get_slice<PersistentTreap>)
@@ -241,19 +437,41 @@ BOOST_PYTHON_MODULE(treap)
         .def("insert", persistent_treap_insert_treap)
         .def("erase", persistent_treap_erase_single)
         .def("erase", persistent_treap_erase_range)
-        .def("set", &PersistentTreap::set)
+        .def("set", persistent_treap_set)
+        .def("compact", &PersistentTreap::compact)
+        .def("view", persistent_treap_view_whole)
+        .def("view", persistent_treap_view_range)
+        .def("__copy__", persistent_treap___copy__)
+        .def("__deepcopy__", persistent_treap___deepcopy__)
+        .def_pickle(container_pickle_suite<PersistentTreap>())
         .def(self + self)
         .def(self * treap_size_t())
         .def(treap_size_t() * self)
-        .def(self == self)
-        .def(self != self)
-        .def(self < self)
-        .def(self <= self)
-        .def(self > self)
-        .def(self >= self)
+        .def("__eq__", persistent_treap_richcompare<Py_EQ>)
+        .def("__ne__", persistent_treap_richcompare<Py_NE>)
+        .def("__lt__", persistent_treap_richcompare<Py_LT>)
+        .def("__le__", persistent_treap_richcompare<Py_LE>)
+        .def("__gt__", persistent_treap_richcompare<Py_GT>)
+        .def("__ge__", persistent_treap_richcompare<Py_GE>)
+        .def("__hash__", persistent_treap___hash__)
+        ;
+
+    iterator_wrapper<PersistentTreapView::const_iterator>().wrap("TreapViewIterator");
+
+    class_<PersistentTreapView>("PersistentTreapView")
+        .def("__init__", make_constructor(persistent_treap_view_from_persistent_treap))
+        .def("__len__", &PersistentTreapView::size)
+        .def("__str__", persistent_treap_view___str__)
+        .def("__repr__", persistent_treap_view___str__)
+        .def("__iter__", &PersistentTreapView::cbegin)
+        .def("__getitem__", &PersistentTreapView::operator[], return_value_policy<copy_const_reference>())
+        .def("__getitem__", container_get_slice<PersistentTreapView>)
+        .def("materialize", &PersistentTreapView::materialize)
+        .def(self + self)
         ;
 
     //iterator_wrapper<Treap::const_iterator>().wrap("TreapIterator");
+    void (Treap::*treap_push_back)(PyObject* const&) = &Treap::push_back;
     void (Treap::*treap_insert_element)(treap_size_t, PyObject* const&) = &Treap::insert;
     void (Treap::*treap_insert_treap)(treap_size_t, const Treap&) = &Treap::insert;
 
@@ -269,7 +487,7 @@ BOOST_PYTHON_MODULE(treap)
         .def("__str__", treap___str__)
         .def("__repr__", treap___str__)
         .def("__iter__", &Treap::cbegin)
-        .def("append", &Treap::push_back)
+        .def("append", treap_push_back)
         .def("pop", &treap_pop, treap_pop_overloads(args("self", "i"), "pop"))
         .def("__getitem__", treap_getitem_const, return_value_policy<copy_const_reference>())
         .def("__getitem__", container_get_slice<Treap>)
@@ -278,15 +496,18 @@ BOOST_PYTHON_MODULE(treap)
         .def("insert", treap_insert_treap)
         .def("erase", treap_erase_single)
         .def("erase", treap_erase_range)
+        .def("__copy__", treap___copy__)
+        .def("__deepcopy__", treap___deepcopy__)
+        .def_pickle(container_pickle_suite<Treap>())
         .def(self + self)
         .def(self * treap_size_t())
         .def(treap_size_t() * self)
-        .def(self == self)
-        .def(self != self)
-        .def(self < self)
-        .def(self <= self)
-        .def(self > self)
-        .def(self >= self)
+        .def("__eq__", treap_richcompare<Py_EQ>)
+        .def("__ne__", treap_richcompare<Py_NE>)
+        .def("__lt__", treap_richcompare<Py_LT>)
+        .def("__le__", treap_richcompare<Py_LE>)
+        .def("__gt__", treap_richcompare<Py_GT>)
+        .def("__ge__", treap_richcompare<Py_GE>)
         ;
     
 }